@@ -0,0 +1,1331 @@
+/*
+ * Directories.
+ *
+ * A directory is a file of blocks mapped like any other legacy file,
+ * block 0 through data_block_number and the rest through the indirect
+ * blocks, and read and written through its own page cache. Its size is
+ * a whole number of blocks.
+ *
+ * Filesystems with the dir packed feature pack variable length records
+ * in each block, see struct simplefs_dir_record_i. Older ones have one
+ * fixed size struct simplefs_dir_record per slot, a linear directory
+ * holding dir_children_count of them from the start of block 0.
+ *
+ * A linear directory is searched record by record. On a filesystem
+ * with the dir index feature a directory whose first block fills up is
+ * turned into a hashed one, loosely after ext3's htree. Block 0 becomes
+ * the root of the index: a table of (hash, leaf block) entries sorted
+ * by hash, entry i covering the names whose hash is at least its own
+ * and below the next one's. The records move to the leaves, which are
+ * blocks 1 and up of the directory. A name is only ever looked for in
+ * the one leaf its hash falls in, and a full leaf is split in two
+ * around its median hash into a new block at the end. Once the root is
+ * full its entries move down to two index blocks laid out like it,
+ * which then split the same way, and the root points to those. A leaf
+ * whose names all have the same hash is split anyway, the entry of its
+ * upper half marked as a continuation, and those names are looked for
+ * in every leaf of the run.
+ *
+ * A record with inode_no 0 is free.
+ *
+ * The readdir position of a linear directory is the byte offset of the
+ * next record, records never move once written. Records of a hashed
+ * directory do move when their leaf is split, so its positions are the
+ * hash of the next name instead, with SIMPLEFS_DX_POS set, and its
+ * leaves are returned in hash order.
+ */
+#include <linux/version.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include "super.h"
+#include "simplefs-lib.h"
+
+/* Readdir positions of a hashed directory, see above */
+#define SIMPLEFS_DX_POS		(1ULL << 33)
+#define SIMPLEFS_DX_POS_EOF	(SIMPLEFS_DX_POS + (1ULL << 32))
+
+/* A record of either format */
+struct simplefs_dirent {
+	uint64_t ino;
+	const char *name;
+	int name_len;
+	unsigned char type;	/*DT_* for readdir*/
+	unsigned off;		/*Offset in the block*/
+	unsigned rec_len;
+};
+
+static inline int simplefs_dir_packed(struct super_block *sb)
+{
+	return SIMPLEFS_SB(sb)->sb.features & SIMPLEFS_FEATURE_DIR_PACKED;
+}
+
+static inline int simplefs_dir_slots(struct super_block *sb)
+{
+	return sb->s_blocksize / sizeof(struct simplefs_dir_record);
+}
+
+/* The fixed format has no room for a type, its records are SIMPLEFS_FT_UNKNOWN */
+static inline uint8_t simplefs_dir_type(umode_t mode)
+{
+	if (S_ISDIR(mode))
+		return SIMPLEFS_FT_DIR;
+	if (S_ISREG(mode))
+		return SIMPLEFS_FT_REG_FILE;
+	return SIMPLEFS_FT_UNKNOWN;
+}
+
+static inline unsigned char simplefs_dir_dtype(uint8_t file_type)
+{
+	switch (file_type) {
+	case SIMPLEFS_FT_DIR:
+		return DT_DIR;
+	case SIMPLEFS_FT_REG_FILE:
+		return DT_REG;
+	}
+	return DT_UNKNOWN;
+}
+
+static inline uint64_t simplefs_dir_blocks(struct inode *dir)
+{
+	return i_size_read(dir) >> dir->i_blkbits;
+}
+
+/* Room a record with a name of len takes */
+static inline unsigned simplefs_dir_rec_size(struct super_block *sb, int len)
+{
+	return simplefs_dir_packed(sb) ? DIR_RECORD_LEN(len) :
+		sizeof(struct simplefs_dir_record);
+}
+
+/*
+ * Bytes of block blk holding records. A packed block is records to its
+ * end, a fixed one whole slots of which a linear directory only uses
+ * the first dir_children_count.
+ */
+static unsigned simplefs_dir_end(struct inode *dir, uint64_t blk)
+{
+	uint64_t count = SIMPLEFS_INODE(dir)->dir_children_count;
+	uint64_t slots = simplefs_dir_slots(dir->i_sb);
+
+	if (simplefs_dir_packed(dir->i_sb))
+		return dir->i_sb->s_blocksize;
+	if (SIMPLEFS_INODE(dir)->flags & SIMPLEFS_INODE_INDEXED ||
+	    count >= (blk + 1) * slots)
+		return slots * sizeof(struct simplefs_dir_record);
+	if (count <= blk * slots)
+		return 0;
+	return (count - blk * slots) * sizeof(struct simplefs_dir_record);
+}
+
+/*
+ * Decode the record at *off of block into *de and move *off to the
+ * next one. Returns 1, 0 past the last record or -EIO if the record
+ * doesn't make sense.
+ */
+static int simplefs_dir_next(struct inode *dir, void *block, unsigned end,
+				unsigned *off, struct simplefs_dirent *de)
+{
+	if (*off >= end)
+		return 0;
+	de->off = *off;
+	if (simplefs_dir_packed(dir->i_sb)) {
+		struct simplefs_dir_record_i *rec = block + *off;
+
+		if (end - *off < DIR_RECORD_BASE_SIZE)
+			goto bad;
+		de->rec_len = le16_to_cpu(rec->rec_len);
+		if (de->rec_len < DIR_RECORD_BASE_SIZE || de->rec_len & 7 ||
+		    de->rec_len > end - *off ||
+		    (rec->inode_no && dir_record_len(rec) > de->rec_len))
+			goto bad;
+		de->ino = le64_to_cpu(rec->inode_no);
+		de->name = rec->filename;
+		de->name_len = rec->name_len;
+		de->type = simplefs_dir_dtype(rec->file_type);
+	} else {
+		struct simplefs_dir_record *rec = block + *off;
+
+		de->rec_len = sizeof(*rec);
+		if (de->rec_len > end - *off)
+			goto bad;
+		de->ino = le64_to_cpu(rec->inode_no);
+		de->name = rec->filename;
+		de->name_len = strnlen(rec->filename, SIMPLEFS_FILENAME_MAXLEN);
+		de->type = DT_UNKNOWN;
+	}
+	*off += de->rec_len;
+	return 1;
+bad:
+	printk(KERN_ERR "simplefs: bad record at %u of directory [%lu]\n",
+		*off, dir->i_ino);
+	return -EIO;
+}
+
+static inline loff_t simplefs_dir_pos(struct inode *dir, uint64_t blk)
+{
+	return (loff_t)blk << dir->i_blkbits;
+}
+
+/*
+ * Block blk of dir out of the page cache, read in if need be. Returns
+ * its address, *pagep is let go with simplefs_dir_put() when done.
+ */
+static void *simplefs_dir_get(struct inode *dir, uint64_t blk,
+				struct page **pagep)
+{
+	loff_t pos = simplefs_dir_pos(dir, blk);
+	struct page *page;
+
+	page = read_mapping_page(dir->i_mapping, pos >> PAGE_CACHE_SHIFT, NULL);
+	if (IS_ERR(page))
+		return ERR_CAST(page);
+	*pagep = page;
+	return kmap(page) + (pos & ~PAGE_CACHE_MASK);
+}
+
+static inline void simplefs_dir_put(struct page *page)
+{
+	kunmap(page);
+	page_cache_release(page);
+}
+
+/*
+ * Get block blk of dir ready to be changed: its page locked and the
+ * block mapped, allocated if it is past the end of the directory, in
+ * which case it reads as zeroes. Returns its address, the change is
+ * finished with simplefs_dir_commit().
+ */
+static void *simplefs_dir_lock(struct inode *dir, uint64_t blk,
+				struct page **pagep)
+{
+	loff_t pos = simplefs_dir_pos(dir, blk);
+	struct page *page;
+	int ret;
+
+	page = read_mapping_page(dir->i_mapping, pos >> PAGE_CACHE_SHIFT, NULL);
+	if (IS_ERR(page))
+		return ERR_CAST(page);
+	lock_page(page);
+	ret = __block_write_begin(page, pos, dir->i_sb->s_blocksize,
+				simplefs_get_block);
+	if (ret) {
+		unlock_page(page);
+		page_cache_release(page);
+		return ERR_PTR(ret);
+	}
+	*pagep = page;
+	return kmap(page) + (pos & ~PAGE_CACHE_MASK);
+}
+
+/*
+ * Dirty the block, growing the directory to cover it. The page is left
+ * for writeback unless the directory is synchronous.
+ */
+static int simplefs_dir_commit(struct inode *dir, uint64_t blk,
+				struct page *page)
+{
+	loff_t pos = simplefs_dir_pos(dir, blk);
+	unsigned len = dir->i_sb->s_blocksize;
+	int ret = 0;
+
+	kunmap(page);
+	block_write_end(NULL, dir->i_mapping, pos, len, len, page, NULL);
+	/* Readers whose position predates this check it, see readdir */
+	dir->i_version++;
+	if (pos + len > i_size_read(dir)) {
+		i_size_write(dir, pos + len);
+		mark_inode_dirty(dir);
+	}
+	if (IS_DIRSYNC(dir)) {
+		ret = write_one_page(page, 1);
+		if (!ret)
+			ret = sync_inode_metadata(dir, 1);
+	} else
+		unlock_page(page);
+	page_cache_release(page);
+	return ret;
+}
+
+/* Replace block blk of dir with buf */
+static int simplefs_dir_write(struct inode *dir, uint64_t blk, const void *buf)
+{
+	struct page *page;
+	void *block;
+
+	block = simplefs_dir_lock(dir, blk, &page);
+	if (IS_ERR(block))
+		return PTR_ERR(block);
+	memcpy(block, buf, dir->i_sb->s_blocksize);
+	return simplefs_dir_commit(dir, blk, page);
+}
+
+/* Set up a block without records */
+static void simplefs_dir_empty(struct super_block *sb, void *block)
+{
+	memset(block, 0, sb->s_blocksize);
+	if (simplefs_dir_packed(sb))
+		((struct simplefs_dir_record_i *)block)->rec_len =
+			cpu_to_le16(sb->s_blocksize);
+}
+
+/*
+ * Write name, ino and its type into the record at off of block. A record
+ * in use keeps what it needs of its room and the new one takes the rest.
+ */
+static void simplefs_dir_place(struct super_block *sb, void *block,
+				unsigned off, const char *name, int len,
+				uint64_t ino, umode_t mode)
+{
+	struct simplefs_dir_record_i *rec = block + off;
+	unsigned rec_len;
+
+	if (!simplefs_dir_packed(sb)) {
+		struct simplefs_dir_record *fixed = block + off;
+
+		memset(fixed, 0, sizeof(*fixed));
+		fixed->inode_no = cpu_to_le64(ino);
+		fixed->name_len = len;
+		memcpy(fixed->filename, name, len);
+		return;
+	}
+	rec_len = le16_to_cpu(rec->rec_len);
+	if (rec->inode_no) {
+		unsigned used = dir_record_len(rec);
+
+		rec->rec_len = cpu_to_le16(used);
+		rec = (void *)rec + used;
+		rec_len -= used;
+	}
+	rec->inode_no = cpu_to_le64(ino);
+	rec->rec_len = cpu_to_le16(rec_len);
+	rec->name_len = len;
+	rec->file_type = simplefs_dir_type(mode);
+	memcpy(rec->filename, name, len);
+}
+
+/*
+ * Offset of a record of the block with room for a new record of size
+ * bytes behind or instead of it, -ENOSPC if there is none.
+ */
+static int simplefs_dir_room(struct inode *dir, void *block, unsigned end,
+				unsigned size)
+{
+	struct simplefs_dirent de;
+	unsigned off = 0;
+	int ret;
+
+	while ((ret = simplefs_dir_next(dir, block, end, &off, &de)) > 0) {
+		unsigned used = de.ino ?
+			simplefs_dir_rec_size(dir->i_sb, de.name_len) : 0;
+
+		if (de.rec_len - used >= size)
+			return de.off;
+	}
+	return ret ? ret : -ENOSPC;
+}
+
+/* Add the record at the room simplefs_dir_room() found in block blk */
+static int simplefs_dir_insert(struct inode *dir, uint64_t blk, unsigned off,
+				const char *name, int len, uint64_t ino,
+				umode_t mode)
+{
+	struct page *page;
+	void *block;
+
+	block = simplefs_dir_lock(dir, blk, &page);
+	if (IS_ERR(block))
+		return PTR_ERR(block);
+	simplefs_dir_place(dir->i_sb, block, off, name, len, ino, mode);
+	return simplefs_dir_commit(dir, blk, page);
+}
+
+static inline int simplefs_dir_match(struct simplefs_dirent *de,
+				const char *name, int len)
+{
+	return de->ino && de->name_len == len &&
+		simplefs_name_eq(de->name, name, len);
+}
+
+/*
+ * Index block blk of dir, the root if blk is 0, out of the page cache.
+ * Returns its address, *pagep is let go with simplefs_dir_put() when
+ * done, or -EIO if it doesn't look like an index block.
+ */
+static struct simplefs_dx_root *simplefs_dx_get(struct inode *dir,
+						uint64_t blk,
+						struct page **pagep)
+{
+	struct simplefs_dx_root *node;
+
+	node = simplefs_dir_get(dir, blk, pagep);
+	if (IS_ERR(node))
+		return node;
+	if (le16_to_cpu(node->magic) != SIMPLEFS_DX_MAGIC || !node->count ||
+	    le16_to_cpu(node->limit) != DX_ROOT_LIMIT(dir->i_sb->s_blocksize) ||
+	    le16_to_cpu(node->count) > le16_to_cpu(node->limit) ||
+	    le16_to_cpu(node->levels) > (blk ? 0 : SIMPLEFS_DX_MAX_LEVELS)) {
+		printk(KERN_ERR "simplefs: bad directory index in inode [%lu]\n",
+			dir->i_ino);
+		simplefs_dir_put(*pagep);
+		return ERR_PTR(-EIO);
+	}
+	return node;
+}
+
+/*
+ * The entry of node to follow for hash, entry 0 starts at hash 0. Of
+ * the entries with the same hash the first is taken unless it is a
+ * continuation, which leaves the names with that hash in the leaf
+ * before.
+ */
+static int simplefs_dx_search(struct simplefs_dx_root *node, uint32_t hash)
+{
+	struct simplefs_dx_entry *entries = DX_FIRST_ENTRY(node);
+	int lo = 1, hi = le16_to_cpu(node->count) - 1, found = 0;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		uint32_t h = le32_to_cpu(entries[mid].hash);
+
+		if (h < hash || (h == hash &&
+		    !(le32_to_cpu(entries[mid].flags) & SIMPLEFS_DX_CONT))) {
+			found = mid;
+			lo = mid + 1;
+		} else
+			hi = mid - 1;
+	}
+	return found;
+}
+
+/*
+ * Where a leaf hangs in the index of a hashed directory: the index
+ * block at each level from the root down and the entry followed in it.
+ */
+struct simplefs_dx_path {
+	int levels;
+	uint64_t node[SIMPLEFS_DX_MAX_LEVELS + 1];
+	int at[SIMPLEFS_DX_MAX_LEVELS + 1];
+	uint64_t leaf;
+	uint32_t hash;		/* Of the leaf's entry */
+	uint32_t flags;		/* Of the leaf's entry */
+};
+
+/*
+ * Follow entry path->at[level] of node down to the leaf, taking the
+ * first entry of every index block below it. Lets go of node.
+ */
+static int simplefs_dx_descend(struct inode *dir, struct simplefs_dx_path *path,
+				int level, struct simplefs_dx_root *node,
+				struct page *page)
+{
+	struct simplefs_dx_entry *entry;
+	uint64_t blk;
+
+	for (;;) {
+		entry = DX_FIRST_ENTRY(node) + path->at[level];
+		blk = le64_to_cpu(entry->block);
+		path->hash = le32_to_cpu(entry->hash);
+		path->flags = le32_to_cpu(entry->flags);
+		simplefs_dir_put(page);
+		if (!blk || blk >= simplefs_dir_blocks(dir))
+			return -EIO;
+		if (level == path->levels)
+			break;
+		level++;
+		path->node[level] = blk;
+		path->at[level] = 0;
+		node = simplefs_dx_get(dir, blk, &page);
+		if (IS_ERR(node))
+			return PTR_ERR(node);
+	}
+	path->leaf = blk;
+	return 0;
+}
+
+/*
+ * Find the leaf of a hashed directory a name with this hash belongs
+ * in, the first one if the names with the hash go on over several.
+ */
+static int simplefs_dx_probe(struct inode *dir, uint32_t hash,
+				struct simplefs_dx_path *path)
+{
+	struct simplefs_dx_root *node;
+	struct page *page;
+	int level = 0;
+
+	path->node[0] = 0;
+	node = simplefs_dx_get(dir, 0, &page);
+	if (IS_ERR(node))
+		return PTR_ERR(node);
+	path->levels = le16_to_cpu(node->levels);
+	for (;;) {
+		path->at[level] = simplefs_dx_search(node, hash);
+		if (level == path->levels)
+			break;
+		path->node[level + 1] = le64_to_cpu(
+			DX_FIRST_ENTRY(node)[path->at[level]].block);
+		simplefs_dir_put(page);
+		if (!path->node[level + 1] ||
+		    path->node[level + 1] >= simplefs_dir_blocks(dir))
+			return -EIO;
+		node = simplefs_dx_get(dir, path->node[++level], &page);
+		if (IS_ERR(node))
+			return PTR_ERR(node);
+	}
+	return simplefs_dx_descend(dir, path, level, node, page);
+}
+
+/* Move path on to the next leaf in hash order, returns 1 past the last */
+static int simplefs_dx_next(struct inode *dir, struct simplefs_dx_path *path)
+{
+	struct simplefs_dx_root *node;
+	struct page *page;
+	int level = path->levels;
+
+	for (;;) {
+		node = simplefs_dx_get(dir, path->node[level], &page);
+		if (IS_ERR(node))
+			return PTR_ERR(node);
+		if (path->at[level] + 1 < le16_to_cpu(node->count))
+			break;
+		simplefs_dir_put(page);
+		if (!level--)
+			return 1;
+	}
+	path->at[level]++;
+	return simplefs_dx_descend(dir, path, level, node, page);
+}
+
+/*
+ * Look name up in block blk of dir. Returns 1 and its inode number in
+ * *ino, 0 if it isn't there.
+ */
+static int simplefs_dir_search(struct inode *dir, uint64_t blk,
+				const char *name, int len, uint64_t *ino)
+{
+	unsigned end = simplefs_dir_end(dir, blk);
+	struct simplefs_dirent de;
+	struct page *page;
+	void *block;
+	unsigned off;
+	int ret = 0;
+
+	if (!end)
+		return 0;
+	block = simplefs_dir_get(dir, blk, &page);
+	if (IS_ERR(block))
+		return PTR_ERR(block);
+	if (simplefs_dir_packed(dir->i_sb)) {
+		/* Straight over the raw records, see simplefs-lib.c */
+		int found = simplefs_dirblock_find(block, end, name, len);
+
+		if (found >= 0) {
+			off = found;
+			ret = simplefs_dir_next(dir, block, end, &off, &de);
+		} else if (found == -2) {
+			printk(KERN_ERR "simplefs: bad record in directory [%lu]\n",
+				dir->i_ino);
+			ret = -EIO;
+		}
+	} else {
+		off = 0;
+		while ((ret = simplefs_dir_next(dir, block, end, &off,
+						&de)) > 0)
+			if (simplefs_dir_match(&de, name, len))
+				break;
+	}
+	if (ret > 0)
+		*ino = de.ino;
+	simplefs_dir_put(page);
+	return ret;
+}
+
+/*
+ * Look name up in dir. Returns 0 and its inode number in *ino, -ENOENT
+ * if there is no such name.
+ */
+int simplefs_dir_find(struct inode *dir, const char *name, int len,
+			uint64_t *ino)
+{
+	struct simplefs_dx_path path;
+	uint32_t hash;
+	uint64_t blk;
+	int ret;
+
+	if (len > SIMPLEFS_FILENAME_MAXLEN)
+		return -ENAMETOOLONG;
+	if (!(SIMPLEFS_INODE(dir)->flags & SIMPLEFS_INODE_INDEXED)) {
+		for (blk = 0; blk < simplefs_dir_blocks(dir); blk++) {
+			ret = simplefs_dir_search(dir, blk, name, len, ino);
+			if (ret)
+				return ret < 0 ? ret : 0;
+		}
+		return -ENOENT;
+	}
+	hash = simplefs_name_hash(name, len);
+	ret = simplefs_dx_probe(dir, hash, &path);
+	while (!ret) {
+		ret = simplefs_dir_search(dir, path.leaf, name, len, ino);
+		if (ret)
+			return ret < 0 ? ret : 0;
+		/* Names with this hash may go on in the next leaves */
+		ret = simplefs_dx_next(dir, &path);
+		if (!ret && (!(path.flags & SIMPLEFS_DX_CONT) ||
+				path.hash != hash))
+			break;
+	}
+	return ret < 0 ? ret : -ENOENT;
+}
+
+/*
+ * Move the records of the full first block of a linear directory to a
+ * new leaf, block 1, and make block 0 the root of the index.
+ */
+static int simplefs_dx_convert(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	struct simplefs_dx_root *root;
+	struct simplefs_dx_entry *entry;
+	struct page *page;
+	void *block, *buf;
+	int ret;
+
+	buf = kmalloc(sb->s_blocksize, GFP_NOFS);
+	if (!buf)
+		return -ENOMEM;
+	block = simplefs_dir_get(dir, 0, &page);
+	if (IS_ERR(block)) {
+		kfree(buf);
+		return PTR_ERR(block);
+	}
+	memcpy(buf, block, sb->s_blocksize);
+	simplefs_dir_put(page);
+	ret = simplefs_dir_write(dir, 1, buf);
+	if (ret)
+		goto out;
+
+	memset(buf, 0, sb->s_blocksize);
+	root = buf;
+	root->magic = cpu_to_le16(SIMPLEFS_DX_MAGIC);
+	root->count = cpu_to_le16(1);
+	root->limit = cpu_to_le16(DX_ROOT_LIMIT(sb->s_blocksize));
+	entry = DX_FIRST_ENTRY(root);
+	entry->hash = 0;
+	entry->block = cpu_to_le64(1);
+	ret = simplefs_dir_write(dir, 0, buf);
+	if (ret)
+		goto out;
+
+	SIMPLEFS_INODE(dir)->flags |= SIMPLEFS_INODE_INDEXED;
+	mark_inode_dirty(dir);
+out:
+	kfree(buf);
+	return ret;
+}
+
+/* A record of a leaf being split */
+struct simplefs_dx_slot {
+	uint32_t hash;
+	unsigned off;
+	unsigned size;
+};
+
+static int simplefs_dx_slot_cmp(const void *a, const void *b)
+{
+	const struct simplefs_dx_slot *x = a, *y = b;
+
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	return 0;
+}
+
+/* Lay the records of src listed in order[] out in the block dst */
+static void simplefs_dx_build(struct super_block *sb, void *dst, void *src,
+				struct simplefs_dx_slot *order, int nr)
+{
+	struct simplefs_dir_record_i *rec = NULL;
+	unsigned off = 0;
+	int i;
+
+	simplefs_dir_empty(sb, dst);
+	for (i = 0; i < nr; i++) {
+		rec = dst + off;
+		memcpy(rec, src + order[i].off, order[i].size);
+		off += order[i].size;
+		if (simplefs_dir_packed(sb))
+			rec->rec_len = cpu_to_le16(order[i].size);
+	}
+	/* The last record gets the rest of the block */
+	if (rec && simplefs_dir_packed(sb))
+		rec->rec_len = cpu_to_le16(sb->s_blocksize -
+					((void *)rec - dst));
+}
+
+/*
+ * Put an entry for block blk, covering hash on, at position nr of the
+ * index block node, which has room for it.
+ */
+static int simplefs_dx_insert(struct inode *dir, uint64_t node, int nr,
+				uint32_t hash, uint32_t flags, uint64_t blk)
+{
+	struct simplefs_dx_entry *entries;
+	struct simplefs_dx_root *root;
+	struct page *page;
+
+	root = simplefs_dir_lock(dir, node, &page);
+	if (IS_ERR(root))
+		return PTR_ERR(root);
+	entries = DX_FIRST_ENTRY(root);
+	memmove(entries + nr + 1, entries + nr,
+		(le16_to_cpu(root->count) - nr) * sizeof(*entries));
+	entries[nr].hash = cpu_to_le32(hash);
+	entries[nr].flags = cpu_to_le32(flags);
+	entries[nr].block = cpu_to_le64(blk);
+	le16_add_cpu(&root->count, 1);
+	return simplefs_dir_commit(dir, node, page);
+}
+
+/* Lay out an index block holding the nr entries of entries */
+static void simplefs_dx_fill(struct super_block *sb, void *dst,
+				struct simplefs_dx_entry *entries, int nr,
+				int levels)
+{
+	struct simplefs_dx_root *node = dst;
+
+	memset(dst, 0, sb->s_blocksize);
+	node->magic = cpu_to_le16(SIMPLEFS_DX_MAGIC);
+	node->count = cpu_to_le16(nr);
+	node->limit = cpu_to_le16(DX_ROOT_LIMIT(sb->s_blocksize));
+	node->levels = cpu_to_le16(levels);
+	memcpy(DX_FIRST_ENTRY(node), entries, nr * sizeof(*entries));
+}
+
+/*
+ * Make room for one more entry next to the one of path's leaf. A full
+ * index block is split in two halves, the upper one going to a new
+ * block at the end of the directory with an entry in the root. A full
+ * root moves its entries down to two new index blocks instead and the
+ * index gets a level deeper. path is updated to where the leaf's entry
+ * is then.
+ */
+static int simplefs_dx_make_room(struct inode *dir,
+				struct simplefs_dx_path *path)
+{
+	struct super_block *sb = dir->i_sb;
+	int level = path->levels, limit = DX_ROOT_LIMIT(sb->s_blocksize);
+	struct simplefs_dx_entry *entries, top[2];
+	struct simplefs_dx_root *node;
+	struct page *page;
+	uint64_t left, right;
+	int count, half, ret;
+	void *buf;
+
+	node = simplefs_dx_get(dir, path->node[level], &page);
+	if (IS_ERR(node))
+		return PTR_ERR(node);
+	count = le16_to_cpu(node->count);
+	simplefs_dir_put(page);
+	if (count < limit)
+		return 0;
+	if (!level)
+		ret = SIMPLEFS_DX_MAX_LEVELS ? 0 : -ENOSPC;
+	else {
+		node = simplefs_dx_get(dir, path->node[level - 1], &page);
+		if (IS_ERR(node))
+			return PTR_ERR(node);
+		ret = le16_to_cpu(node->count) < limit ? 0 : -ENOSPC;
+		simplefs_dir_put(page);
+	}
+	if (ret)
+		return ret;
+
+	buf = kmalloc(3 * sb->s_blocksize, GFP_NOFS);
+	if (!buf)
+		return -ENOMEM;
+	node = simplefs_dx_get(dir, path->node[level], &page);
+	if (IS_ERR(node)) {
+		ret = PTR_ERR(node);
+		goto out;
+	}
+	memcpy(buf, node, sb->s_blocksize);
+	simplefs_dir_put(page);
+	entries = DX_FIRST_ENTRY((struct simplefs_dx_root *)buf);
+	half = count / 2;
+	simplefs_dx_fill(sb, buf + sb->s_blocksize, entries, half, 0);
+	simplefs_dx_fill(sb, buf + 2 * sb->s_blocksize, entries + half,
+			count - half, 0);
+
+	right = simplefs_dir_blocks(dir);
+	ret = simplefs_dir_write(dir, right, buf + 2 * sb->s_blocksize);
+	if (ret)
+		goto out;
+	if (level) {
+		left = path->node[level];
+		ret = simplefs_dir_write(dir, left, buf + sb->s_blocksize);
+		if (!ret)
+			ret = simplefs_dx_insert(dir, path->node[level - 1],
+					path->at[level - 1] + 1,
+					le32_to_cpu(entries[half].hash),
+					le32_to_cpu(entries[half].flags), right);
+	} else {
+		left = simplefs_dir_blocks(dir);
+		ret = simplefs_dir_write(dir, left, buf + sb->s_blocksize);
+		if (ret)
+			goto out;
+		/* The root is left with the two new index blocks */
+		top[0].hash = 0;
+		top[0].flags = 0;
+		top[0].block = cpu_to_le64(left);
+		top[1] = entries[half];
+		top[1].block = cpu_to_le64(right);
+		simplefs_dx_fill(sb, buf, top, 2, 1);
+		ret = simplefs_dir_write(dir, 0, buf);
+		if (ret)
+			goto out;
+		path->levels = level = 1;
+		path->node[1] = left;
+		path->at[1] = path->at[0];
+		path->at[0] = 0;
+	}
+	if (ret)
+		goto out;
+	if (path->at[level] >= half) {
+		path->node[level] = right;
+		path->at[level] -= half;
+		path->at[level - 1]++;
+	}
+out:
+	kfree(buf);
+	return ret;
+}
+
+/*
+ * Split the full leaf of path in two halves of about the same size by
+ * hash, the upper one going to a new block at the end of the directory
+ * whose entry goes right after the leaf's. Names with the same hash
+ * stay in the same leaf, unless the leaf holds nothing else, then the
+ * upper half continues them. The leaf's index block must have room for
+ * the entry, see simplefs_dx_make_room(). path is moved to the half
+ * that hash now belongs to.
+ */
+static int simplefs_dx_split(struct inode *dir, struct simplefs_dx_path *path,
+				uint32_t hash)
+{
+	struct super_block *sb = dir->i_sb;
+	int max = sb->s_blocksize / DIR_RECORD_BASE_SIZE, count = 0, split, ret;
+	uint64_t block = simplefs_dir_blocks(dir);
+	struct simplefs_dx_slot *order;
+	struct simplefs_dirent de;
+	unsigned off = 0, total = 0, half;
+	uint32_t split_hash, flags = 0;
+	void *addr, *old, *left, *right;
+	struct page *page;
+	int i;
+
+	old = kmalloc(3 * sb->s_blocksize, GFP_NOFS);
+	order = kmalloc(max * sizeof(*order), GFP_NOFS);
+	if (!old || !order) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	left = old + sb->s_blocksize;
+	right = old + 2 * sb->s_blocksize;
+
+	addr = simplefs_dir_get(dir, path->leaf, &page);
+	if (IS_ERR(addr)) {
+		ret = PTR_ERR(addr);
+		goto out;
+	}
+	memcpy(old, addr, sb->s_blocksize);
+	simplefs_dir_put(page);
+
+	while ((ret = simplefs_dir_next(dir, old,
+					simplefs_dir_end(dir, path->leaf),
+					&off, &de)) > 0) {
+		if (!de.ino)
+			continue;
+		order[count].hash = simplefs_name_hash(de.name, de.name_len);
+		order[count].off = de.off;
+		order[count].size = simplefs_dir_rec_size(sb, de.name_len);
+		total += order[count++].size;
+	}
+	if (ret)
+		goto out;
+	if (count < 2) {
+		ret = -ENOSPC;
+		goto out;
+	}
+	sort(order, count, sizeof(*order), simplefs_dx_slot_cmp, NULL);
+
+	for (split = 0, half = 0; split < count && half < total / 2; split++)
+		half += order[split].size;
+	split = clamp(split, 1, count - 1);
+	/* Move the split point off a run of equal hashes */
+	for (i = split; i < count && order[i].hash == order[i - 1].hash; i++)
+		;
+	if (i == count)
+		for (i = split; i > 0 && order[i].hash == order[i - 1].hash; i--)
+			;
+	if (i)
+		split = i;
+	else
+		/* All of them have the same hash */
+		flags = SIMPLEFS_DX_CONT;
+	split_hash = order[split].hash;
+	simplefs_dx_build(sb, left, old, order, split);
+	simplefs_dx_build(sb, right, old, order + split, count - split);
+
+	ret = simplefs_dir_write(dir, block, right);
+	if (!ret)
+		ret = simplefs_dir_write(dir, path->leaf, left);
+	if (!ret)
+		ret = simplefs_dx_insert(dir, path->node[path->levels],
+					path->at[path->levels] + 1,
+					split_hash, flags, block);
+	if (!ret && hash >= split_hash) {
+		path->leaf = block;
+		path->at[path->levels]++;
+		path->hash = split_hash;
+		path->flags = flags;
+	}
+out:
+	kfree(order);
+	kfree(old);
+	return ret;
+}
+
+/* Offset in block blk with room for a record of size bytes */
+static int simplefs_dir_find_room(struct inode *dir, uint64_t blk,
+				unsigned size)
+{
+	struct page *page;
+	void *block;
+	int off;
+
+	block = simplefs_dir_get(dir, blk, &page);
+	if (IS_ERR(block))
+		return PTR_ERR(block);
+	off = simplefs_dir_room(dir, block, simplefs_dir_end(dir, blk), size);
+	simplefs_dir_put(page);
+	return off;
+}
+
+static int simplefs_dx_add(struct inode *dir, const char *name, int len,
+				uint64_t ino, umode_t mode)
+{
+	unsigned size = simplefs_dir_rec_size(dir->i_sb, len);
+	uint32_t hash = simplefs_name_hash(name, len);
+	struct simplefs_dx_path path, next;
+	int off, ret;
+
+	ret = simplefs_dx_probe(dir, hash, &path);
+	if (ret)
+		return ret;
+	/* Names with this hash may go on in the next leaves */
+	while ((off = simplefs_dir_find_room(dir, path.leaf, size)) == -ENOSPC) {
+		next = path;
+		ret = simplefs_dx_next(dir, &next);
+		if (ret < 0)
+			return ret;
+		if (ret || !(next.flags & SIMPLEFS_DX_CONT) || next.hash != hash)
+			break;
+		path = next;
+	}
+	if (off == -ENOSPC) {
+		ret = simplefs_dx_make_room(dir, &path);
+		if (!ret)
+			ret = simplefs_dx_split(dir, &path, hash);
+		if (ret)
+			return ret;
+		off = simplefs_dir_find_room(dir, path.leaf, size);
+	}
+	if (off < 0)
+		return off;
+	return simplefs_dir_insert(dir, path.leaf, off, name, len, ino, mode);
+}
+
+/*
+ * Add to a linear directory, in the first block with room or in a new
+ * one. Returns -EAGAIN if the directory should be hashed instead.
+ */
+static int simplefs_dir_add_linear(struct inode *dir, const char *name,
+				int len, uint64_t ino, umode_t mode)
+{
+	struct super_block *sb = dir->i_sb;
+	uint64_t count = SIMPLEFS_INODE(dir)->dir_children_count;
+	uint64_t blk, nr_blocks = simplefs_dir_blocks(dir);
+	int slots = simplefs_dir_slots(sb);
+	struct page *page;
+	void *block;
+	int off = -ENOSPC;
+
+	if (simplefs_dir_packed(sb)) {
+		for (blk = 0; blk < nr_blocks && off == -ENOSPC; blk++)
+			off = simplefs_dir_find_room(dir, blk,
+						DIR_RECORD_LEN(len));
+		if (off >= 0)
+			return simplefs_dir_insert(dir, blk - 1, off, name,
+						len, ino, mode);
+		if (off != -ENOSPC)
+			return off;
+	} else if (count < nr_blocks * slots)
+		/* Fixed records are packed, the next one goes at count */
+		return simplefs_dir_insert(dir, count / slots,
+				(count % slots) * sizeof(struct simplefs_dir_record),
+				name, len, ino, mode);
+
+	if ((SIMPLEFS_SB(sb)->sb.features & SIMPLEFS_FEATURE_DIR_INDEX) &&
+	    nr_blocks == 1)
+		return -EAGAIN;
+	block = simplefs_dir_lock(dir, nr_blocks, &page);
+	if (IS_ERR(block))
+		return PTR_ERR(block);
+	simplefs_dir_empty(sb, block);
+	simplefs_dir_place(sb, block, 0, name, len, ino, mode);
+	return simplefs_dir_commit(dir, nr_blocks, page);
+}
+
+/*
+ * Add name pointing to ino, an inode of type mode, to dir and count it
+ * in dir_children_count. The caller writes the directory inode out.
+ * Returns -EEXIST if dir already has the name, looked up with the same
+ * scan as simplefs_dir_find(). A hashed directory only has to look in
+ * the leaves the name's hash leads to.
+ */
+int simplefs_dir_add(struct inode *dir, const char *name, int len,
+			uint64_t ino, umode_t mode)
+{
+	struct simple_fs_inode_i *minode = SIMPLEFS_INODE(dir);
+	uint64_t old_ino;
+	int ret;
+
+	ret = simplefs_dir_find(dir, name, len, &old_ino);
+	if (ret != -ENOENT)
+		return ret ? ret : -EEXIST;
+	if (!(minode->flags & SIMPLEFS_INODE_INDEXED)) {
+		ret = simplefs_dir_add_linear(dir, name, len, ino, mode);
+		if (ret == -EAGAIN) {
+			ret = simplefs_dx_convert(dir);
+			if (!ret)
+				ret = simplefs_dx_add(dir, name, len, ino, mode);
+		}
+	} else
+		ret = simplefs_dx_add(dir, name, len, ino, mode);
+	if (ret == -EFBIG)
+		ret = -ENOSPC;
+	if (!ret)
+		minode->dir_children_count++;
+	return ret;
+}
+
+/*
+ * Format the first block of a new directory, which has no records.
+ * Whatever the format, the block may hold anything from its last use.
+ */
+int simplefs_dir_init(struct inode *dir)
+{
+	struct page *page;
+	void *block;
+
+	block = simplefs_dir_lock(dir, 0, &page);
+	if (IS_ERR(block))
+		return PTR_ERR(block);
+	simplefs_dir_empty(dir->i_sb, block);
+	return simplefs_dir_commit(dir, 0, page);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0)
+/* What ->iterate is given on newer kernels, set up by simplefs_readdir() */
+struct dir_context {
+	void *dirent;
+	filldir_t actor;
+	loff_t pos;
+};
+
+static inline bool dir_emit(struct dir_context *ctx, const char *name,
+				int len, u64 ino, unsigned type)
+{
+	return ctx->actor(ctx->dirent, name, len, ctx->pos, ino, type) == 0;
+}
+#endif
+
+/*
+ * ls -l and find stat every entry right after readdir. Start reading
+ * all the inode table blocks they need now, in one go, instead of one
+ * block per stat as the lookups come.
+ */
+static int simplefs_readdir_prefetch(struct inode *dir, void *block,
+					unsigned off, unsigned end)
+{
+	struct super_block *sb = dir->i_sb;
+	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(sb);
+	struct simplefs_dirent de;
+	uint64_t last_block = 0;
+	int ret;
+
+	while ((ret = simplefs_dir_next(dir, block, end, &off, &de)) > 0) {
+		uint64_t table;
+
+		if (!de.ino)
+			continue;
+		table = (de.ino - 1) / SIMPLEFS_INODES_PER_BLOCK(msblk);
+		if (!last_block || table + 1 != last_block)
+			simplefs_inode_readahead(sb, de.ino);
+		last_block = table + 1;
+	}
+	return ret;
+}
+
+/*
+ * Entries whose table block is already in the cache are cheap to set
+ * up, put the ones returned in [off, end) in the inode cache for the
+ * lookups.
+ */
+static void simplefs_readdir_warm(struct inode *dir, void *block,
+					unsigned off, unsigned end)
+{
+	struct super_block *sb = dir->i_sb;
+	struct simplefs_dirent de;
+
+	while (simplefs_dir_next(dir, block, end, &off, &de) > 0) {
+		struct inode *child;
+
+		if (!de.ino || !simplefs_inode_readahead(sb, de.ino))
+			continue;
+		child = simplefs_iget(sb, de.ino);
+		if (!IS_ERR(child))
+			iput(child);
+	}
+}
+
+/*
+ * Read the rest of the directory from blk on ahead, unless blk is in
+ * the page cache already.
+ */
+static void simplefs_dir_readahead(struct file *filp, uint64_t blk)
+{
+	struct inode *dir = filp->f_mapping->host;
+	pgoff_t index = simplefs_dir_pos(dir, blk) >> PAGE_CACHE_SHIFT;
+	pgoff_t last = (i_size_read(dir) - 1) >> PAGE_CACHE_SHIFT;
+	struct page *page;
+
+	page = find_get_page(dir->i_mapping, index);
+	if (page) {
+		page_cache_release(page);
+		return;
+	}
+	page_cache_sync_readahead(dir->i_mapping, &filp->f_ra, filp, index,
+				last - index + 1);
+}
+
+/*
+ * Offset of the first record of the block at or after off. A position
+ * set by a seek may point into the middle of a record.
+ */
+static unsigned simplefs_dir_realign(struct inode *dir, void *block,
+					unsigned off, unsigned end)
+{
+	struct simplefs_dirent de;
+	unsigned pos = 0;
+
+	while (pos < off && simplefs_dir_next(dir, block, end, &pos, &de) > 0)
+		;
+	return pos;
+}
+
+/*
+ * Return the records of a linear directory from ctx->pos on, a block
+ * at a time, until the caller has no room left.
+ */
+static int simplefs_readdir_linear(struct file *filp, struct dir_context *ctx)
+{
+	struct inode *dir = filp->f_mapping->host;
+	uint64_t blk, nr_blocks = simplefs_dir_blocks(dir);
+	unsigned off, from;
+	struct simplefs_dirent de;
+	struct page *page;
+	void *block;
+	int ret;
+
+	blk = ctx->pos >> dir->i_blkbits;
+	off = ctx->pos & (dir->i_sb->s_blocksize - 1);
+	for (; blk < nr_blocks; blk++, off = 0) {
+		loff_t base = simplefs_dir_pos(dir, blk);
+		unsigned end = simplefs_dir_end(dir, blk);
+
+		if (!end)
+			break;
+		simplefs_dir_readahead(filp, blk);
+		block = simplefs_dir_get(dir, blk, &page);
+		if (IS_ERR(block))
+			return PTR_ERR(block);
+		if (filp->f_version != dir->i_version) {
+			off = simplefs_dir_realign(dir, block, off, end);
+			ctx->pos = base + off;
+			filp->f_version = dir->i_version;
+		}
+		ret = simplefs_readdir_prefetch(dir, block, off, end);
+		if (ret < 0) {
+			simplefs_dir_put(page);
+			return ret;
+		}
+		from = off;
+		while ((ret = simplefs_dir_next(dir, block, end, &off, &de)) > 0) {
+			if (de.ino && !dir_emit(ctx, de.name, de.name_len,
+						de.ino, de.type))
+				break;
+			ctx->pos = base + off;
+		}
+		if (ret >= 0)
+			simplefs_readdir_warm(dir, block, from, ctx->pos - base);
+		simplefs_dir_put(page);
+		if (ret)
+			return ret < 0 ? ret : 0;
+		ctx->pos = simplefs_dir_pos(dir, blk + 1);
+	}
+	return 0;
+}
+
+/*
+ * Return the names of a hashed directory from the hash in ctx->pos on,
+ * leaf after leaf and in hash order within each. Names sharing a hash
+ * are all returned again if the caller runs out of room among them,
+ * and so are those of a hash going on from one leaf into the next if
+ * a call ends between the two.
+ */
+static int simplefs_readdir_dx(struct file *filp, struct dir_context *ctx)
+{
+	struct inode *dir = filp->f_mapping->host;
+	struct super_block *sb = dir->i_sb;
+	int max = sb->s_blocksize / DIR_RECORD_BASE_SIZE;
+	struct simplefs_dx_slot *order;
+	struct simplefs_dx_path path;
+	uint32_t hash;
+	int ret;
+
+	/* A position from before the directory was hashed starts over */
+	if (!(ctx->pos & SIMPLEFS_DX_POS))
+		ctx->pos = SIMPLEFS_DX_POS;
+	if (ctx->pos >= SIMPLEFS_DX_POS_EOF)
+		return 0;
+	order = kmalloc(max * sizeof(*order), GFP_KERNEL);
+	if (!order)
+		return -ENOMEM;
+	hash = ctx->pos - SIMPLEFS_DX_POS;
+	ret = simplefs_dx_probe(dir, hash, &path);
+	while (!ret) {
+		unsigned off = 0, end;
+		struct simplefs_dirent de;
+		struct page *page;
+		void *block;
+		int count = 0, i;
+
+		end = simplefs_dir_end(dir, path.leaf);
+		simplefs_dir_readahead(filp, path.leaf);
+		block = simplefs_dir_get(dir, path.leaf, &page);
+		if (IS_ERR(block)) {
+			ret = PTR_ERR(block);
+			break;
+		}
+		ret = simplefs_readdir_prefetch(dir, block, 0, end);
+		while (ret >= 0 &&
+		       (ret = simplefs_dir_next(dir, block, end, &off, &de)) > 0) {
+			if (!de.ino)
+				continue;
+			order[count].hash = simplefs_name_hash(de.name,
+							de.name_len);
+			order[count].off = de.off;
+			if (order[count].hash >= hash)
+				count++;
+		}
+		if (ret < 0) {
+			simplefs_dir_put(page);
+			break;
+		}
+		sort(order, count, sizeof(*order), simplefs_dx_slot_cmp, NULL);
+		for (i = 0; i < count; i++) {
+			off = order[i].off;
+			simplefs_dir_next(dir, block, end, &off, &de);
+			ctx->pos = SIMPLEFS_DX_POS + order[i].hash;
+			if (!dir_emit(ctx, de.name, de.name_len, de.ino,
+					de.type))
+				break;
+		}
+		simplefs_readdir_warm(dir, block, 0, end);
+		simplefs_dir_put(page);
+		if (i < count)
+			break;
+		ret = simplefs_dx_next(dir, &path);
+		if (ret > 0) {
+			ctx->pos = SIMPLEFS_DX_POS_EOF;
+			ret = 0;
+			break;
+		}
+		/* Leaves out of hash order would have us go round forever */
+		if (!ret && path.hash < hash)
+			ret = -EIO;
+		if (!ret) {
+			hash = path.hash;
+			ctx->pos = SIMPLEFS_DX_POS + hash;
+		}
+	}
+	kfree(order);
+	return ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0)
+int simplefs_iterate(struct file *filp, struct dir_context *ctx)
+#else
+static int simplefs_iterate(struct file *filp, struct dir_context *ctx)
+#endif
+{
+	struct inode *inode = filp->f_mapping->host;
+
+	if (unlikely(!S_ISDIR(inode->i_mode))) {
+		printk(KERN_ERR "inode [%lu] is not a directory\n",
+		       inode->i_ino);
+		return -ENOTDIR;
+	}
+	if (SIMPLEFS_INODE(inode)->flags & SIMPLEFS_INODE_INDEXED)
+		return simplefs_readdir_dx(filp, ctx);
+	return simplefs_readdir_linear(filp, ctx);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0)
+int simplefs_readdir(struct file *filp, void *dirent, filldir_t filldir)
+{
+	struct dir_context ctx = {
+		.dirent = dirent,
+		.actor = filldir,
+		.pos = filp->f_pos,
+	};
+	int ret;
+
+	ret = simplefs_iterate(filp, &ctx);
+	filp->f_pos = ctx.pos;
+	return ret;
+}
+#endif
+
+/*
+ * Positions of a hashed directory are past i_size, let seekdir() get
+ * back to them. Older kernels only seek up to s_maxbytes, rewinddir()
+ * and reading on still work there.
+ */
+loff_t simplefs_dir_llseek(struct file *filp, loff_t offset, int whence)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0)
+	struct inode *dir = filp->f_mapping->host;
+	loff_t eof = SIMPLEFS_INODE(dir)->flags & SIMPLEFS_INODE_INDEXED ?
+			SIMPLEFS_DX_POS_EOF : i_size_read(dir);
+
+	return generic_file_llseek_size(filp, offset, whence,
+				SIMPLEFS_DX_POS_EOF, eof);
+#else
+	return generic_file_llseek(filp, offset, whence);
+#endif
+}
@@ -0,0 +1,655 @@
+/*
+ * Extent based block mapping for simplefs.
+ *
+ * A file with SIMPLEFS_INODE_EXTENTS keeps the root of its extent tree
+ * in the inode's block_area. The root holds a few extents itself, once
+ * they are used up its content is pushed down into a block and the root
+ * keeps index entries instead. Tree blocks are split in the same way
+ * when they fill up, so the tree only ever grows at the root.
+ *
+ * Extents allocated by fallocate are unwritten. They read as zeroes
+ * and are converted to normal extents when they are first written.
+ *
+ * The tree is protected by map_sem of the in-memory inode.
+ */
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/falloc.h>
+#include "super.h"
+
+struct simplefs_ext_path {
+	struct buffer_head *bh;	/* NULL for the root in the inode */
+	struct simplefs_extent_header *hdr;
+	int idx;		/* Entry followed at this level, -1 if none */
+};
+
+static inline struct simplefs_extent_header *
+simplefs_ext_root(struct inode *vfs_inode)
+{
+	return (struct simplefs_extent_header *)
+		SIMPLEFS_INODE(vfs_inode)->block_area;
+}
+
+static inline uint32_t simplefs_ext_entries(struct simplefs_extent_header *hdr)
+{
+	return le16_to_cpu(hdr->entries);
+}
+
+static inline void simplefs_ext_set_entries(struct simplefs_extent_header *hdr,
+						uint32_t entries)
+{
+	hdr->entries = cpu_to_le16(entries);
+}
+
+static inline uint32_t simplefs_ext_len(struct simplefs_extent *ext)
+{
+	return le32_to_cpu(ext->length) & ~SIMPLEFS_EXT_UNWRITTEN;
+}
+
+static inline uint32_t simplefs_ext_unwritten(struct simplefs_extent *ext)
+{
+	return le32_to_cpu(ext->length) & SIMPLEFS_EXT_UNWRITTEN;
+}
+
+static void simplefs_ext_init_header(struct simplefs_extent_header *hdr,
+					uint16_t max, uint16_t depth)
+{
+	hdr->magic = cpu_to_le16(SIMPLEFS_EXT_MAGIC);
+	hdr->entries = 0;
+	hdr->max = cpu_to_le16(max);
+	hdr->depth = cpu_to_le16(depth);
+}
+
+/*
+ * Turn an inode without blocks into an extent mapped one.
+ */
+void simplefs_ext_init(struct simple_fs_inode_i *minode)
+{
+	BUILD_BUG_ON(sizeof(struct simplefs_extent) !=
+			sizeof(struct simplefs_extent_idx));
+	minode->flags |= SIMPLEFS_INODE_EXTENTS;
+	simplefs_ext_init_header((struct simplefs_extent_header *)minode->block_area,
+				SIMPLEFS_EXT_ROOT_MAX, 0);
+}
+
+/*
+ * Both extents and index entries start with the logical block and have
+ * the same size so one search does for both. Returns the last entry
+ * starting at or before lblk, -1 if there is none.
+ */
+static int simplefs_ext_search(struct simplefs_extent_header *hdr, uint32_t lblk)
+{
+	struct simplefs_extent *ext = EXT_FIRST_EXTENT(hdr);
+	int lo = 0, hi = (int)simplefs_ext_entries(hdr) - 1, found = -1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+
+		if (le32_to_cpu(ext[mid].logical) <= lblk) {
+			found = mid;
+			lo = mid + 1;
+		} else
+			hi = mid - 1;
+	}
+	return found;
+}
+
+static void simplefs_ext_drop_path(struct simplefs_ext_path *path, int depth)
+{
+	int level;
+
+	for (level = 1; level <= depth; level++)
+		brelse(path[level].bh);
+}
+
+/*
+ * Walk down to the leaf which should hold lblk. Returns the depth
+ * of the tree, path[depth] being the leaf.
+ */
+static int simplefs_ext_find(struct inode *vfs_inode, uint32_t lblk,
+				struct simplefs_ext_path *path)
+{
+	struct simplefs_extent_header *hdr = simplefs_ext_root(vfs_inode);
+	int depth = le16_to_cpu(hdr->depth);
+	int level;
+
+	if (le16_to_cpu(hdr->magic) != SIMPLEFS_EXT_MAGIC ||
+			depth > SIMPLEFS_EXT_MAX_DEPTH) {
+		printk(KERN_ERR "Corrupt extent root in inode [%lu]\n",
+			vfs_inode->i_ino);
+		return -EIO;
+	}
+	memset(path, 0, sizeof(*path) * (depth + 1));
+	path[0].hdr = hdr;
+	for (level = 0; level < depth; level++) {
+		struct simplefs_extent_idx *idx;
+		struct buffer_head *bh;
+
+		/* The first index entry covers everything before it too */
+		path[level].idx = max(simplefs_ext_search(path[level].hdr, lblk), 0);
+		idx = EXT_FIRST_INDEX(path[level].hdr) + path[level].idx;
+		bh = sb_bread(vfs_inode->i_sb, le64_to_cpu(idx->block));
+		if (!bh)
+			goto fail;
+		path[level + 1].bh = bh;
+		path[level + 1].hdr = (struct simplefs_extent_header *)bh->b_data;
+		if (le16_to_cpu(path[level + 1].hdr->magic) != SIMPLEFS_EXT_MAGIC ||
+			le16_to_cpu(path[level + 1].hdr->depth) != depth - level - 1) {
+			printk(KERN_ERR "Corrupt extent block [%llu] in inode [%lu]\n",
+				le64_to_cpu(idx->block), vfs_inode->i_ino);
+			level++;
+			goto fail;
+		}
+	}
+	path[depth].idx = simplefs_ext_search(path[depth].hdr, lblk);
+	return depth;
+fail:
+	simplefs_ext_drop_path(path, level);
+	return -EIO;
+}
+
+static void simplefs_ext_dirty(struct inode *vfs_inode,
+				struct simplefs_ext_path *path, int level)
+{
+	if (path[level].bh)
+		mark_buffer_dirty_inode(path[level].bh, vfs_inode);
+	else
+		mark_inode_dirty(vfs_inode);
+}
+
+/*
+ * First logical block after lblk which is already mapped, this bounds
+ * how much can be allocated for a hole at lblk.
+ */
+static uint64_t simplefs_ext_next_mapped(struct simplefs_ext_path *path,
+					int depth)
+{
+	int level;
+
+	for (level = depth; level >= 0; level--) {
+		struct simplefs_extent_header *hdr = path[level].hdr;
+		int idx = path[level].idx;
+
+		if (idx + 1 < (int)simplefs_ext_entries(hdr))
+			return le32_to_cpu(EXT_FIRST_EXTENT(hdr)[idx + 1].logical);
+	}
+	return SIMPLEFS_EXT_MAX_LBLK + 1;
+}
+
+/*
+ * Get a new zeroed tree block. The buffer is returned locked.
+ */
+static struct buffer_head *simplefs_ext_new_node(struct inode *vfs_inode)
+{
+	struct buffer_head *bh;
+	uint64_t block = allocate_data_blocks(vfs_inode, 1, 0, 0);
+
+	if (!block)
+		return ERR_PTR(-ENOSPC);
+	bh = sb_getblk(vfs_inode->i_sb, block);
+	if (!bh) {
+		simplefs_free_data_blocks(vfs_inode->i_sb, block, 1);
+		return ERR_PTR(-EIO);
+	}
+	lock_buffer(bh);
+	memset(bh->b_data, 0, bh->b_size);
+	set_buffer_uptodate(bh);
+	return bh;
+}
+
+/*
+ * The root is full. Move everything it has into a new block and make
+ * the root a single index entry pointing to that block.
+ */
+static int simplefs_ext_grow(struct inode *vfs_inode)
+{
+	struct simplefs_extent_header *root = simplefs_ext_root(vfs_inode);
+	struct simplefs_extent_header *hdr;
+	struct simplefs_extent_idx *idx;
+	struct buffer_head *bh;
+	int depth = le16_to_cpu(root->depth);
+
+	if (depth >= SIMPLEFS_EXT_MAX_DEPTH)
+		return -EFBIG;
+	bh = simplefs_ext_new_node(vfs_inode);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	hdr = (struct simplefs_extent_header *)bh->b_data;
+	memcpy(hdr, root, sizeof(*root) +
+		simplefs_ext_entries(root) * sizeof(struct simplefs_extent));
+	hdr->max = cpu_to_le16(EXT_BLOCK_MAX(bh->b_size));
+	unlock_buffer(bh);
+	mark_buffer_dirty_inode(bh, vfs_inode);
+
+	simplefs_ext_init_header(root, SIMPLEFS_EXT_ROOT_MAX, depth + 1);
+	simplefs_ext_set_entries(root, 1);
+	idx = EXT_FIRST_INDEX(root);
+	idx->logical = 0;
+	idx->unused = 0;
+	idx->block = cpu_to_le64(bh->b_blocknr);
+	brelse(bh);
+	mark_inode_dirty(vfs_inode);
+	return 0;
+}
+
+/*
+ * The node at path[level] is full. Split it, making room in the parent
+ * first if needed. The path is stale afterwards, the caller looks the
+ * block up again.
+ */
+static int simplefs_ext_split(struct inode *vfs_inode,
+				struct simplefs_ext_path *path, int level)
+{
+	struct simplefs_extent_header *parent, *hdr, *new_hdr;
+	struct simplefs_extent_idx *idx;
+	struct simplefs_extent *first;
+	struct buffer_head *bh;
+	uint32_t entries, move;
+
+	if (!level)
+		return simplefs_ext_grow(vfs_inode);
+	parent = path[level - 1].hdr;
+	if (simplefs_ext_entries(parent) == le16_to_cpu(parent->max))
+		return simplefs_ext_split(vfs_inode, path, level - 1);
+
+	bh = simplefs_ext_new_node(vfs_inode);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	hdr = path[level].hdr;
+	entries = simplefs_ext_entries(hdr);
+	/*
+	 * Appending files always insert at the end, don't leave half
+	 * empty nodes behind them.
+	 */
+	move = (path[level].idx == entries - 1) ? 1 : entries / 2;
+	first = EXT_FIRST_EXTENT(hdr) + entries - move;
+
+	new_hdr = (struct simplefs_extent_header *)bh->b_data;
+	simplefs_ext_init_header(new_hdr, EXT_BLOCK_MAX(bh->b_size),
+				le16_to_cpu(hdr->depth));
+	memcpy(EXT_FIRST_EXTENT(new_hdr), first, move * sizeof(*first));
+	simplefs_ext_set_entries(new_hdr, move);
+	simplefs_ext_set_entries(hdr, entries - move);
+	unlock_buffer(bh);
+	mark_buffer_dirty_inode(bh, vfs_inode);
+	simplefs_ext_dirty(vfs_inode, path, level);
+
+	idx = EXT_FIRST_INDEX(parent) + path[level - 1].idx + 1;
+	memmove(idx + 1, idx, (simplefs_ext_entries(parent) -
+				path[level - 1].idx - 1) * sizeof(*idx));
+	idx->logical = EXT_FIRST_EXTENT(new_hdr)->logical;
+	idx->unused = 0;
+	idx->block = cpu_to_le64(bh->b_blocknr);
+	simplefs_ext_set_entries(parent, simplefs_ext_entries(parent) + 1);
+	simplefs_ext_dirty(vfs_inode, path, level - 1);
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * Add newext to the tree, merging it with the extent in front of it
+ * when they are contiguous both logically and on disk.
+ */
+static int simplefs_ext_insert(struct inode *vfs_inode,
+				struct simplefs_extent *newext)
+{
+	struct simplefs_ext_path path[SIMPLEFS_EXT_MAX_DEPTH + 1];
+	struct simplefs_extent_header *leaf;
+	struct simplefs_extent *ext;
+	uint32_t lblk = le32_to_cpu(newext->logical);
+	uint32_t len = simplefs_ext_len(newext);
+	uint32_t entries;
+	int depth, idx, ret;
+
+again:
+	depth = simplefs_ext_find(vfs_inode, lblk, path);
+	if (depth < 0)
+		return depth;
+	leaf = path[depth].hdr;
+	idx = path[depth].idx;
+	entries = simplefs_ext_entries(leaf);
+	if (idx >= 0) {
+		uint32_t ext_len;
+
+		ext = EXT_FIRST_EXTENT(leaf) + idx;
+		ext_len = simplefs_ext_len(ext);
+		if (le32_to_cpu(ext->logical) + ext_len == lblk &&
+			le64_to_cpu(ext->physical) + ext_len ==
+					le64_to_cpu(newext->physical) &&
+			simplefs_ext_unwritten(ext) == simplefs_ext_unwritten(newext) &&
+			ext_len + len <= SIMPLEFS_EXT_MAX_LEN) {
+			ext->length = cpu_to_le32((ext_len + len) |
+						simplefs_ext_unwritten(ext));
+			goto out;
+		}
+	}
+	if (entries == le16_to_cpu(leaf->max)) {
+		ret = simplefs_ext_split(vfs_inode, path, depth);
+		simplefs_ext_drop_path(path, depth);
+		if (ret)
+			return ret;
+		goto again;
+	}
+	ext = EXT_FIRST_EXTENT(leaf) + idx + 1;
+	memmove(ext + 1, ext, (entries - idx - 1) * sizeof(*ext));
+	*ext = *newext;
+	simplefs_ext_set_entries(leaf, entries + 1);
+out:
+	simplefs_ext_dirty(vfs_inode, path, depth);
+	simplefs_ext_drop_path(path, depth);
+	return 0;
+}
+
+/*
+ * Map up to max_blocks blocks from lblk. Returns how many blocks are
+ * mapped contiguously from *phys, 0 for a hole. *unwritten tells if
+ * they belong to an unwritten extent.
+ */
+static int simplefs_ext_lookup(struct inode *vfs_inode, uint32_t lblk,
+				uint32_t max_blocks, uint64_t *phys,
+				int *unwritten)
+{
+	struct simplefs_ext_path path[SIMPLEFS_EXT_MAX_DEPTH + 1];
+	struct simplefs_extent *ext;
+	uint32_t start, len;
+	int depth, ret = 0;
+
+	depth = simplefs_ext_find(vfs_inode, lblk, path);
+	if (depth < 0)
+		return depth;
+	if (path[depth].idx >= 0) {
+		ext = EXT_FIRST_EXTENT(path[depth].hdr) + path[depth].idx;
+		start = le32_to_cpu(ext->logical);
+		len = simplefs_ext_len(ext);
+		if (lblk < start + len) {
+			*phys = le64_to_cpu(ext->physical) + (lblk - start);
+			*unwritten = !!simplefs_ext_unwritten(ext);
+			ret = min(max_blocks, start + len - lblk);
+		}
+	}
+	simplefs_ext_drop_path(path, depth);
+	return ret;
+}
+
+/*
+ * Where the blocks for a hole at lblk should go: right behind the
+ * extent before it, else behind the leaf block. 0 if the file has no
+ * blocks before lblk at all.
+ */
+static uint64_t simplefs_ext_goal(struct simplefs_ext_path *path, int depth,
+					uint32_t lblk)
+{
+	int idx = path[depth].idx;
+
+	if (idx >= 0) {
+		struct simplefs_extent *ext = EXT_FIRST_EXTENT(path[depth].hdr) + idx;
+
+		return le64_to_cpu(ext->physical) + lblk -
+			le32_to_cpu(ext->logical);
+	}
+	if (path[depth].bh)
+		return path[depth].bh->b_blocknr + 1;
+	return 0;
+}
+
+/*
+ * Fill the hole at lblk with as many contiguous blocks as we can get,
+ * up to max_blocks. flags may have SIMPLEFS_EXT_UNWRITTEN and
+ * SIMPLEFS_ALLOC_RESERVED.
+ */
+static int simplefs_ext_alloc(struct inode *vfs_inode, uint32_t lblk,
+				uint32_t max_blocks, uint64_t *phys,
+				uint32_t flags)
+{
+	struct simplefs_ext_path path[SIMPLEFS_EXT_MAX_DEPTH + 1];
+	struct simplefs_extent newext;
+	uint64_t hole_end, goal, block = 0;
+	uint32_t count;
+	int depth, ret;
+
+	depth = simplefs_ext_find(vfs_inode, lblk, path);
+	if (depth < 0)
+		return depth;
+	hole_end = simplefs_ext_next_mapped(path, depth);
+	goal = simplefs_ext_goal(path, depth, lblk);
+	simplefs_ext_drop_path(path, depth);
+
+	count = min_t(uint64_t, max_blocks, hole_end - lblk);
+	count = min_t(uint32_t, count, SIMPLEFS_EXT_MAX_LEN);
+	while (count && !(block = allocate_data_blocks(vfs_inode, count, goal,
+						flags & SIMPLEFS_ALLOC_RESERVED)))
+		count >>= 1;
+	if (!block)
+		return -ENOSPC;
+
+	newext.logical = cpu_to_le32(lblk);
+	newext.length = cpu_to_le32(count | (flags & SIMPLEFS_EXT_UNWRITTEN));
+	newext.physical = cpu_to_le64(block);
+	ret = simplefs_ext_insert(vfs_inode, &newext);
+	if (ret) {
+		simplefs_free_data_blocks(vfs_inode->i_sb, block, count);
+		return ret;
+	}
+	*phys = block;
+	return count;
+}
+
+/*
+ * Unwritten extents up to this many blocks are converted as a whole,
+ * zeroing the part that isn't being written, rather than split.
+ */
+#define SIMPLEFS_EXT_ZEROOUT_LEN	16
+
+/*
+ * Zero the blocks of [start, start + len) on disk except the
+ * [lblk, lblk + count) part which is about to be written.
+ */
+static int simplefs_ext_zeroout(struct inode *vfs_inode, uint32_t start,
+				uint32_t len, uint64_t phys,
+				uint32_t lblk, uint32_t count)
+{
+	struct super_block *sb = vfs_inode->i_sb;
+	uint32_t head = lblk - start, tail = len - head - count;
+	int ret = 0;
+
+	if (head)
+		ret = sb_issue_zeroout(sb, phys, head, GFP_NOFS);
+	if (!ret && tail)
+		ret = sb_issue_zeroout(sb, phys + head + count, tail, GFP_NOFS);
+	return ret;
+}
+
+/*
+ * [lblk, lblk + count) of an unwritten extent is about to be written.
+ * Split the extent so that this part becomes a normal extent. Small
+ * extents, and ones we can't split for lack of space, are zeroed on
+ * disk and converted as a whole instead.
+ */
+static int simplefs_ext_convert(struct inode *vfs_inode, uint32_t lblk,
+				uint32_t count)
+{
+	struct simplefs_ext_path path[SIMPLEFS_EXT_MAX_DEPTH + 1];
+	struct simplefs_extent *ext, newext;
+	uint32_t start, len, head, tail;
+	uint64_t phys;
+	int depth, ret;
+
+	depth = simplefs_ext_find(vfs_inode, lblk, path);
+	if (depth < 0)
+		return depth;
+	ret = 0;
+	if (path[depth].idx < 0)
+		goto out_drop;
+	ext = EXT_FIRST_EXTENT(path[depth].hdr) + path[depth].idx;
+	start = le32_to_cpu(ext->logical);
+	len = simplefs_ext_len(ext);
+	phys = le64_to_cpu(ext->physical);
+	if (!simplefs_ext_unwritten(ext) || lblk >= start + len)
+		goto out_drop;
+	count = min(count, start + len - lblk);
+	head = lblk - start;
+	tail = len - head - count;
+
+	if (len <= SIMPLEFS_EXT_ZEROOUT_LEN || (!head && !tail)) {
+		ret = simplefs_ext_zeroout(vfs_inode, start, len, phys, lblk, count);
+		if (ret)
+			goto out_drop;
+		ext->length = cpu_to_le32(len);
+		goto out;
+	}
+
+	/* The extent keeps the head, or the written part if there's no head */
+	ext->length = cpu_to_le32(head ? (head | SIMPLEFS_EXT_UNWRITTEN) : count);
+	simplefs_ext_dirty(vfs_inode, path, depth);
+	simplefs_ext_drop_path(path, depth);
+
+	ret = 0;
+	if (head) {
+		newext.logical = cpu_to_le32(lblk);
+		newext.length = cpu_to_le32(count);
+		newext.physical = cpu_to_le64(phys + head);
+		ret = simplefs_ext_insert(vfs_inode, &newext);
+	}
+	if (!ret && tail) {
+		newext.logical = cpu_to_le32(lblk + count);
+		newext.length = cpu_to_le32(tail | SIMPLEFS_EXT_UNWRITTEN);
+		newext.physical = cpu_to_le64(phys + head + count);
+		ret = simplefs_ext_insert(vfs_inode, &newext);
+	}
+	if (!ret)
+		return 0;
+
+	/*
+	 * No room to split. Whatever extent now starts at or before lblk
+	 * is stretched back to the end of the original one and made
+	 * written, with everything but the written part zeroed on disk.
+	 */
+	ret = simplefs_ext_zeroout(vfs_inode, start, len, phys, lblk, count);
+	if (ret)
+		return ret;
+	depth = simplefs_ext_find(vfs_inode, lblk, path);
+	if (depth < 0)
+		return depth;
+	ext = EXT_FIRST_EXTENT(path[depth].hdr) + path[depth].idx;
+	ext->length = cpu_to_le32(start + len - le32_to_cpu(ext->logical));
+out:
+	simplefs_ext_dirty(vfs_inode, path, depth);
+out_drop:
+	simplefs_ext_drop_path(path, depth);
+	return ret;
+}
+
+/*
+ * get_block for extent mapped files. Maps as many blocks as bh_result
+ * asks for, as long as they are contiguous on disk.
+ */
+int simplefs_ext_get_block(struct inode *vfs_inode, sector_t iblock,
+				struct buffer_head *bh_result, int create)
+{
+	struct simple_fs_inode_i *minode = SIMPLEFS_INODE(vfs_inode);
+	uint32_t max_blocks = bh_result->b_size >> vfs_inode->i_blkbits;
+	uint64_t phys = 0;
+	int ret, new = 0, unwritten = 0;
+
+	if (iblock > SIMPLEFS_EXT_MAX_LBLK)
+		return -EFBIG;
+	if (!max_blocks)
+		max_blocks = 1;
+
+	down_read(&minode->map_sem);
+	ret = simplefs_ext_lookup(vfs_inode, iblock, max_blocks, &phys, &unwritten);
+	up_read(&minode->map_sem);
+
+	if (!create) {
+		/* Unwritten blocks read as a hole, no need to go to disk */
+		if (unwritten)
+			return 0;
+	} else if (!ret || unwritten) {
+		down_write(&minode->map_sem);
+		/* Somebody might have filled the hole meanwhile */
+		unwritten = 0;
+		ret = simplefs_ext_lookup(vfs_inode, iblock, max_blocks,
+					&phys, &unwritten);
+		if (ret > 0 && unwritten) {
+			ret = simplefs_ext_convert(vfs_inode, iblock, ret);
+			if (!ret)
+				ret = simplefs_ext_lookup(vfs_inode, iblock,
+						max_blocks, &phys, &unwritten);
+			new = 1;
+		} else if (!ret) {
+			ret = simplefs_ext_alloc(vfs_inode, iblock, max_blocks,
+						&phys, create & SIMPLEFS_ALLOC_RESERVED);
+			new = 1;
+		}
+		up_write(&minode->map_sem);
+	}
+	if (ret <= 0)
+		return ret;
+
+	map_bh(bh_result, vfs_inode->i_sb, phys);
+	bh_result->b_size = (size_t)ret << vfs_inode->i_blkbits;
+	if (new)
+		set_buffer_new(bh_result);
+	return 0;
+}
+
+/*
+ * Preallocate [offset, offset + len) with unwritten extents, using
+ * contiguous runs wherever the allocator can give them. Only extent
+ * mapped files support it, an inline file is moved to extents first.
+ */
+long simplefs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+	struct inode *vfs_inode = file->f_path.dentry->d_inode;
+	struct simple_fs_inode_i *minode = SIMPLEFS_INODE(vfs_inode);
+	uint64_t lblk, end, phys;
+	int unwritten, ret = 0;
+
+	if (mode & ~FALLOC_FL_KEEP_SIZE)
+		return -EOPNOTSUPP;
+	if (!(SIMPLEFS_SB(vfs_inode->i_sb)->sb.features & SIMPLEFS_FEATURE_EXTENTS))
+		return -EOPNOTSUPP;
+	if (offset < 0 || len <= 0)
+		return -EINVAL;
+	lblk = offset >> vfs_inode->i_blkbits;
+	end = (offset + len - 1) >> vfs_inode->i_blkbits;
+	if (end > SIMPLEFS_EXT_MAX_LBLK)
+		return -EFBIG;
+
+	inode_lock(vfs_inode);
+	if (minode->flags & SIMPLEFS_INODE_INLINE) {
+		ret = simplefs_inline_to_blocks(vfs_inode);
+		if (ret)
+			goto out;
+	}
+	if (!(minode->flags & SIMPLEFS_INODE_EXTENTS)) {
+		ret = -EOPNOTSUPP;
+		goto out;
+	}
+	down_write(&minode->map_sem);
+	while (lblk <= end) {
+		uint32_t want = min_t(uint64_t, end - lblk + 1, SIMPLEFS_EXT_MAX_LEN);
+
+		ret = simplefs_ext_lookup(vfs_inode, lblk, want, &phys, &unwritten);
+		if (!ret)
+			ret = simplefs_ext_alloc(vfs_inode, lblk, want, &phys,
+						SIMPLEFS_EXT_UNWRITTEN);
+		if (ret < 0)
+			break;
+		lblk += ret;
+		ret = 0;
+	}
+	up_write(&minode->map_sem);
+
+	if (!ret) {
+		if (!(mode & FALLOC_FL_KEEP_SIZE) &&
+				offset + len > i_size_read(vfs_inode))
+			i_size_write(vfs_inode, offset + len);
+		vfs_inode->i_ctime = CURRENT_TIME;
+		mark_inode_dirty(vfs_inode);
+	}
+out:
+	inode_unlock(vfs_inode);
+	return ret;
+}
@@ -0,0 +1,356 @@
+/*
+ * In-memory index of the free extents of each block group.
+ *
+ * Built from the block bitmap when the group is loaded and kept in
+ * sync by the group allocator under the group lock. A group keeps its
+ * free runs in an rbtree ordered by start bit, each node also knowing
+ * the longest run in its subtree, so "n free blocks at or after goal"
+ * is a walk down the tree instead of a walk over the bitmap.
+ *
+ * The bitmap stays the authority. A group whose index can't be kept
+ * up, because there is no memory for a node or because it is too
+ * fragmented to be worth it, drops the index and goes back to
+ * scanning its bitmap. Frees merge runs again, so every so many frees
+ * such a group counts its runs and is indexed again once they are down
+ * to half the limit.
+ */
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/rbtree_augmented.h>
+#include "super.h"
+#include "simplefs-lib.h"
+
+/*
+ * Past this many free runs in a group the index costs more memory
+ * than it saves in bitmap scanning.
+ */
+#define SIMPLEFS_FEXT_MAX_NODES	512
+/* Runs a group without an index may have to be indexed again */
+#define SIMPLEFS_FEXT_REBUILD_NODES	(SIMPLEFS_FEXT_MAX_NODES / 2)
+
+struct simplefs_fext {
+	struct rb_node rb;
+	uint32_t start;		/*First free bit in the group*/
+	uint32_t len;
+	uint32_t subtree_max;	/*Longest len in this subtree*/
+};
+
+static inline struct simplefs_fext *fext_entry(struct rb_node *node)
+{
+	return node ? rb_entry(node, struct simplefs_fext, rb) : NULL;
+}
+
+static inline uint32_t fext_compute_max(struct simplefs_fext *e)
+{
+	uint32_t max = e->len;
+
+	if (e->rb.rb_left && fext_entry(e->rb.rb_left)->subtree_max > max)
+		max = fext_entry(e->rb.rb_left)->subtree_max;
+	if (e->rb.rb_right && fext_entry(e->rb.rb_right)->subtree_max > max)
+		max = fext_entry(e->rb.rb_right)->subtree_max;
+	return max;
+}
+
+RB_DECLARE_CALLBACKS(static, fext_callbacks, struct simplefs_fext, rb,
+			uint32_t, subtree_max, fext_compute_max)
+
+static void fext_insert(struct rb_root *root, struct simplefs_fext *new)
+{
+	struct rb_node **link = &root->rb_node, *parent = NULL;
+
+	new->subtree_max = new->len;
+	while (*link) {
+		struct simplefs_fext *e = fext_entry(*link);
+
+		parent = *link;
+		if (e->subtree_max < new->len)
+			e->subtree_max = new->len;
+		link = new->start < e->start ? &parent->rb_left : &parent->rb_right;
+	}
+	rb_link_node(&new->rb, parent, link);
+	rb_insert_augmented(&new->rb, root, &fext_callbacks);
+}
+
+static void fext_erase(struct simple_fs_sb_i *msblk,
+			struct simple_fs_group_i *group, struct simplefs_fext *e)
+{
+	rb_erase_augmented(&e->rb, &group->free_extents, &fext_callbacks);
+	group->nr_free_extents--;
+	atomic_long_dec(&msblk->free_extent_nodes);
+	kfree(e);
+}
+
+/* e changed its start or len in place */
+static inline void fext_changed(struct simplefs_fext *e)
+{
+	fext_callbacks.propagate(&e->rb, NULL);
+}
+
+/*
+ * Lowest free extent with at least n blocks at or after goal.
+ */
+static struct simplefs_fext *fext_search(struct rb_node *node,
+					uint32_t goal, uint32_t n)
+{
+	while (node) {
+		struct simplefs_fext *e = fext_entry(node), *found;
+
+		if (e->subtree_max < n)
+			return NULL;
+		if (e->start + e->len <= goal) {
+			/* This one and everything left of it end before goal */
+			node = node->rb_right;
+			continue;
+		}
+		found = fext_search(node->rb_left, goal, n);
+		if (found)
+			return found;
+		if (e->start + e->len - max(e->start, goal) >= n)
+			return e;
+		node = node->rb_right;
+	}
+	return NULL;
+}
+
+/* Last free extent starting before bit */
+static struct simplefs_fext *fext_prev(struct rb_root *root, uint32_t bit)
+{
+	struct rb_node *node = root->rb_node;
+	struct simplefs_fext *prev = NULL;
+
+	while (node) {
+		struct simplefs_fext *e = fext_entry(node);
+
+		if (e->start < bit) {
+			prev = e;
+			node = node->rb_right;
+		} else
+			node = node->rb_left;
+	}
+	return prev;
+}
+
+void simplefs_fext_drop(struct simple_fs_sb_i *msblk,
+			struct simple_fs_group_i *group)
+{
+	struct rb_node *node;
+
+	while ((node = rb_first(&group->free_extents))) {
+		rb_erase(node, &group->free_extents);
+		kfree(fext_entry(node));
+	}
+	atomic_long_sub(group->nr_free_extents, &msblk->free_extent_nodes);
+	group->nr_free_extents = 0;
+	group->indexed = 0;
+}
+
+/*
+ * Index the free runs of the group's bitmap. Nodes come from pool, nr
+ * of them, which is left with the ones not used, or are allocated if
+ * pool is NULL.
+ */
+static int fext_index(struct simple_fs_sb_i *msblk,
+			struct simple_fs_group_i *group, const char *bitmap,
+			struct simplefs_fext **pool, uint32_t *nr)
+{
+	int32_t nr_bits = group->bitmap_len << 3;
+	int32_t bit = 0, end;
+
+	group->free_extents = RB_ROOT;
+	group->nr_free_extents = 0;
+	group->indexed = 0;
+	while ((bit = find_bmap_zero(bitmap, group->bitmap_len, bit)) >= 0) {
+		struct simplefs_fext *e;
+
+		end = find_bmap_one(bitmap, group->bitmap_len, bit);
+		if (end < 0)
+			end = nr_bits;
+		if (group->nr_free_extents == SIMPLEFS_FEXT_MAX_NODES)
+			goto fail;
+		if (pool)
+			e = *nr ? pool[--*nr] : NULL;
+		else
+			e = kmalloc(sizeof(*e), GFP_NOFS | __GFP_NOWARN);
+		if (!e)
+			goto fail;
+		e->start = bit;
+		e->len = end - bit;
+		fext_insert(&group->free_extents, e);
+		group->nr_free_extents++;
+		atomic_long_inc(&msblk->free_extent_nodes);
+		bit = end;
+	}
+	group->indexed = 1;
+	return 0;
+fail:
+	simplefs_fext_drop(msblk, group);
+	return -ENOMEM;
+}
+
+/*
+ * Index the free runs of the group's bitmap. Called when the group is
+ * loaded, before anybody else can look at it.
+ */
+int simplefs_fext_build(struct simple_fs_sb_i *msblk,
+			struct simple_fs_group_i *group, const char *bitmap)
+{
+	return fext_index(msblk, group, bitmap, NULL, NULL);
+}
+
+/* Free runs in the bitmap, counting stops past max */
+static uint32_t fext_count_runs(const char *bitmap, int32_t len, uint32_t max)
+{
+	int32_t bit = 0;
+	uint32_t runs = 0;
+
+	while (runs <= max && (bit = find_bmap_zero(bitmap, len, bit)) >= 0) {
+		runs++;
+		bit = find_bmap_one(bitmap, len, bit);
+		if (bit < 0)
+			break;
+	}
+	return runs;
+}
+
+/*
+ * Index a group which dropped its index again if its free runs are few
+ * enough now. The nodes are allocated before the group lock is taken,
+ * a few more than counted since the bitmap can change in between.
+ * Called without the group lock, with the group's bitmap block held.
+ */
+void simplefs_fext_rebuild(struct simple_fs_sb_i *msblk,
+			struct simple_fs_group_i *group, const char *bitmap)
+{
+	struct simplefs_fext **pool;
+	uint32_t nr, i;
+
+	spin_lock(&group->lock);
+	nr = group->indexed ? 0 : fext_count_runs(bitmap, group->bitmap_len,
+						SIMPLEFS_FEXT_REBUILD_NODES);
+	spin_unlock(&group->lock);
+	if (!nr || nr > SIMPLEFS_FEXT_REBUILD_NODES)
+		return;
+	nr += 8;
+	pool = kmalloc(nr * sizeof(*pool), GFP_NOFS | __GFP_NOWARN);
+	if (!pool)
+		return;
+	for (i = 0; i < nr; i++) {
+		pool[i] = simplefs_fext_alloc_node();
+		if (!pool[i])
+			break;
+	}
+	nr = i;
+	spin_lock(&group->lock);
+	if (!group->indexed)
+		fext_index(msblk, group, bitmap, pool, &nr);
+	spin_unlock(&group->lock);
+	while (nr)
+		kfree(pool[--nr]);
+	kfree(pool);
+}
+
+/*
+ * Take n blocks out of the index, at or after goal if possible.
+ * Returns the first bit or -1. A run taken from the middle of a free
+ * extent splits it, the second half goes in *spare which is cleared
+ * then. Without a spare node the run is taken from the start of the
+ * extent instead. Called with the group lock held.
+ */
+int32_t simplefs_fext_alloc(struct simple_fs_sb_i *msblk,
+			struct simple_fs_group_i *group,
+			uint32_t goal, uint32_t n, struct simplefs_fext **spare)
+{
+	struct simplefs_fext *e, *new;
+	uint32_t start, end;
+
+	e = fext_search(group->free_extents.rb_node, goal, n);
+	if (!e && goal) {
+		goal = 0;
+		e = fext_search(group->free_extents.rb_node, 0, n);
+	}
+	if (!e)
+		return -1;
+	start = max(e->start, goal);
+	end = e->start + e->len;
+	if (start != e->start && start + n != end) {
+		if (*spare && group->nr_free_extents < SIMPLEFS_FEXT_MAX_NODES) {
+			e->len = start - e->start;
+			fext_changed(e);
+			new = *spare;
+			*spare = NULL;
+			new->start = start + n;
+			new->len = end - new->start;
+			fext_insert(&group->free_extents, new);
+			group->nr_free_extents++;
+			atomic_long_inc(&msblk->free_extent_nodes);
+			return start;
+		}
+		start = e->start;
+	}
+	if (start == e->start) {
+		e->start += n;
+		e->len -= n;
+		if (!e->len) {
+			fext_erase(msblk, group, e);
+			return start;
+		}
+	} else
+		e->len -= n;
+	fext_changed(e);
+	return start;
+}
+
+/*
+ * Put [bit, bit + n) back into the index, merging it with its
+ * neighbours. *spare is used if a new node is needed and cleared when
+ * that happens. Without one the group drops its index.
+ * Called with the group lock held.
+ */
+void simplefs_fext_free(struct simple_fs_sb_i *msblk,
+			struct simple_fs_group_i *group,
+			uint32_t bit, uint32_t n, struct simplefs_fext **spare)
+{
+	struct simplefs_fext *prev, *next, *new;
+
+	prev = fext_prev(&group->free_extents, bit);
+	next = prev ? fext_entry(rb_next(&prev->rb)) :
+			fext_entry(rb_first(&group->free_extents));
+	if (prev && prev->start + prev->len == bit) {
+		prev->len += n;
+		if (next && bit + n == next->start) {
+			prev->len += next->len;
+			fext_erase(msblk, group, next);
+		}
+		fext_changed(prev);
+		return;
+	}
+	if (next && bit + n == next->start) {
+		next->start = bit;
+		next->len += n;
+		fext_changed(next);
+		return;
+	}
+	if (!*spare || group->nr_free_extents == SIMPLEFS_FEXT_MAX_NODES) {
+		simplefs_fext_drop(msblk, group);
+		return;
+	}
+	new = *spare;
+	*spare = NULL;
+	new->start = bit;
+	new->len = n;
+	fext_insert(&group->free_extents, new);
+	group->nr_free_extents++;
+	atomic_long_inc(&msblk->free_extent_nodes);
+}
+
+struct simplefs_fext *simplefs_fext_alloc_node(void)
+{
+	return kmalloc(sizeof(struct simplefs_fext), GFP_NOFS | __GFP_NOWARN);
+}
+
+/* Bytes used by the free extent index of the whole filesystem */
+unsigned long simplefs_fext_memory(struct simple_fs_sb_i *msblk)
+{
+	return atomic_long_read(&msblk->free_extent_nodes) *
+		sizeof(struct simplefs_fext);
+}
@@ -0,0 +1,144 @@
+/*
+ * Inode number allocation.
+ *
+ * Inode numbers come from the on-disk inode bitmap, bit n standing for
+ * inode n + 1. Each cpu keeps a few numbers already marked in use in
+ * the bitmap so that creates running on different cpus don't all
+ * queue up on the bitmap. Numbers still sitting in a batch are given
+ * back at umount, a crash before that leaves them marked in use.
+ */
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/percpu.h>
+#include "super.h"
+#include "simplefs-lib.h"
+
+/*
+ * Mark up to nr free inode numbers in use and store them in ino[].
+ * Returns how many were found.
+ */
+static int simplefs_ino_grab(struct super_block *sb, uint64_t *ino, int nr)
+{
+	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(sb);
+	uint64_t max_bits = SIMPLEFS_MAX_INODES(msblk);
+	uint32_t bits_per_block = msblk->sb.block_size << 3;
+	uint32_t nr_blocks = min_t(uint64_t, msblk->inode_bitmap.nr,
+				DIV_ROUND_UP(max_bits, bits_per_block));
+	uint32_t i, block;
+	int got = 0;
+
+	mutex_lock(&msblk->ino_mutex);
+	block = msblk->ino_hint / bits_per_block;
+	/* Once around all the bitmap blocks starting from the hint */
+	for (i = 0; i < nr_blocks && got < nr; i++, block++) {
+		struct buffer_head *bh;
+		uint64_t first;
+		int32_t hint, len, bit;
+		int before = got;
+
+		if (block >= nr_blocks)
+			block = 0;
+		first = (uint64_t)block * bits_per_block;
+		/* Bits past the last inode slot are never handed out */
+		len = min_t(uint64_t, bits_per_block, max_bits - first) >> 3;
+		hint = msblk->ino_hint > first ? msblk->ino_hint - first : 0;
+		if (hint >= len << 3)
+			hint = 0;
+		bh = simplefs_meta_bread(sb, &msblk->inode_bitmap, block);
+		if (!bh)
+			continue;
+		while (got < nr &&
+			(bit = alloc_bmap_hint(bh->b_data, len, &hint)) >= 0) {
+			ino[got++] = first + bit + 1;
+			msblk->ino_hint = first + hint;
+		}
+		if (got > before)
+			simplefs_meta_dirty(sb, &msblk->inode_bitmap, bh);
+		brelse(bh);
+	}
+	mutex_unlock(&msblk->ino_mutex);
+	return got;
+}
+
+void simplefs_free_inode_no(struct super_block *sb, uint64_t ino)
+{
+	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(sb);
+	uint32_t bits_per_block = msblk->sb.block_size << 3;
+	struct buffer_head *bh;
+
+	if (!ino || ino > SIMPLEFS_MAX_INODES(msblk))
+		return;
+	ino--;
+	bh = simplefs_meta_bread(sb, &msblk->inode_bitmap, ino / bits_per_block);
+	if (!bh)
+		return;
+	mutex_lock(&msblk->ino_mutex);
+	if (free_bmap(bh->b_data, msblk->sb.block_size, ino % bits_per_block))
+		simplefs_meta_dirty(sb, &msblk->inode_bitmap, bh);
+	mutex_unlock(&msblk->ino_mutex);
+	brelse(bh);
+}
+
+/*
+ * Get an unused inode number, 0 if there is none left.
+ */
+uint64_t simplefs_new_inode_no(struct super_block *sb)
+{
+	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(sb);
+	struct simplefs_ino_batch *batch;
+	uint64_t ino[SIMPLEFS_INO_BATCH];
+	int nr, i = 1;
+
+	batch = get_cpu_ptr(msblk->ino_batch);
+	if (batch->nr) {
+		ino[0] = batch->ino[--batch->nr];
+		put_cpu_ptr(msblk->ino_batch);
+		return ino[0];
+	}
+	put_cpu_ptr(msblk->ino_batch);
+
+	nr = simplefs_ino_grab(sb, ino, SIMPLEFS_INO_BATCH);
+	if (!nr)
+		return 0;
+	/* Keep the rest for the next creates on this cpu */
+	batch = get_cpu_ptr(msblk->ino_batch);
+	while (i < nr && batch->nr < SIMPLEFS_INO_BATCH)
+		batch->ino[batch->nr++] = ino[i++];
+	put_cpu_ptr(msblk->ino_batch);
+	/* We slept, somebody else may have filled the batch meanwhile */
+	while (i < nr)
+		simplefs_free_inode_no(sb, ino[i++]);
+	return ino[0];
+}
+
+int simplefs_ialloc_init(struct super_block *sb)
+{
+	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(sb);
+
+	mutex_init(&msblk->ino_mutex);
+	msblk->ino_hint = 0;
+	msblk->ino_batch = alloc_percpu(struct simplefs_ino_batch);
+	return msblk->ino_batch ? 0 : -ENOMEM;
+}
+
+/*
+ * Give the numbers still in the per cpu batches back to the bitmap.
+ * Called at umount, before the metadata is written out.
+ */
+void simplefs_ialloc_destroy(struct super_block *sb)
+{
+	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(sb);
+	int cpu;
+
+	if (!msblk->ino_batch)
+		return;
+	for_each_possible_cpu(cpu) {
+		struct simplefs_ino_batch *batch =
+			per_cpu_ptr(msblk->ino_batch, cpu);
+
+		while (batch->nr)
+			simplefs_free_inode_no(sb, batch->ino[--batch->nr]);
+	}
+	free_percpu(msblk->ino_batch);
+	msblk->ino_batch = NULL;
+}
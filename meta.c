@@ -0,0 +1,422 @@
+/*
+ * Metadata blocks: the inode table and the two bitmaps.
+ *
+ * Nothing is read at mount. A block is read the first time somebody
+ * asks for it and the blocks following it are read ahead
+ * asynchronously since the inode table and the bitmaps are mostly
+ * walked in order.
+ *
+ * Blocks read so far are kept in a small per mount cache with a
+ * bounded number of entries. The least recently used clean ones are
+ * dropped when it is full or when the VM asks for memory back through
+ * the shrinker. Dropping an entry only gives up our reference, the
+ * block stays in the block device page cache until that is reclaimed.
+ * A write error of a dropped block is kept for simplefs_meta_wait().
+ *
+ * An area looks its cached blocks up in a radix tree, so the memory
+ * used goes with what is cached rather than with the size of the
+ * filesystem. Cached blocks which were dirtied are kept on a list of
+ * the area, sync only looks at those.
+ */
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/module.h>
+#include <linux/seq_file.h>
+#include <linux/radix-tree.h>
+#include <linux/version.h>
+#include "super.h"
+
+/* Blocks read ahead behind a block which had to be read */
+#define SIMPLEFS_META_RA	8
+
+static unsigned long meta_cache_blocks = 1024;
+module_param(meta_cache_blocks, ulong, 0644);
+MODULE_PARM_DESC(meta_cache_blocks,
+		"Metadata blocks cached per mount, 1024 by default");
+
+struct simplefs_meta_entry {
+	struct list_head lru;
+	struct list_head dirty;		/* On the area dirty list */
+	struct list_head writeback;	/* On the area writeback list */
+	struct buffer_head *bh;
+	struct simplefs_meta_area *area;
+	uint32_t index;
+};
+
+/* Called with the cache lock held */
+static void simplefs_meta_forget(struct simplefs_meta_cache *cache,
+				struct simplefs_meta_entry *entry)
+{
+	radix_tree_delete(&entry->area->entries, entry->index);
+	list_del(&entry->lru);
+	list_del(&entry->dirty);
+	list_del(&entry->writeback);
+	cache->nr_cached--;
+	brelse(entry->bh);
+	kfree(entry);
+}
+
+/*
+ * An entry can go if nobody but the cache holds the block and it has
+ * nothing left to write. Called with the cache lock held.
+ */
+static int simplefs_meta_evict(struct simplefs_meta_cache *cache,
+				struct simplefs_meta_entry *entry)
+{
+	struct buffer_head *bh = entry->bh;
+
+	if (atomic_read(&bh->b_count) > 1 || buffer_dirty(bh) ||
+			buffer_locked(bh))
+		return 0;
+	if (buffer_write_io_error(bh)) {
+		clear_buffer_write_io_error(bh);
+		cache->write_error = -EIO;
+	}
+	simplefs_meta_forget(cache, entry);
+	return 1;
+}
+
+/*
+ * Drop up to nr_to_scan least recently used entries which can be
+ * dropped, returns how many went.
+ */
+static unsigned long simplefs_meta_prune(struct simplefs_meta_cache *cache,
+					unsigned long nr_to_scan)
+{
+	struct simplefs_meta_entry *entry, *next;
+	unsigned long freed = 0;
+
+	list_for_each_entry_safe(entry, next, &cache->lru, lru) {
+		if (!nr_to_scan--)
+			break;
+		freed += simplefs_meta_evict(cache, entry);
+	}
+	return freed;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,12,0)
+static unsigned long simplefs_meta_count(struct shrinker *shrink,
+					struct shrink_control *sc)
+{
+	struct simplefs_meta_cache *cache =
+		container_of(shrink, struct simplefs_meta_cache, shrinker);
+
+	return ACCESS_ONCE(cache->nr_cached);
+}
+
+static unsigned long simplefs_meta_scan(struct shrinker *shrink,
+					struct shrink_control *sc)
+{
+	struct simplefs_meta_cache *cache =
+		container_of(shrink, struct simplefs_meta_cache, shrinker);
+	unsigned long freed;
+
+	spin_lock(&cache->lock);
+	freed = simplefs_meta_prune(cache, sc->nr_to_scan);
+	spin_unlock(&cache->lock);
+	return freed;
+}
+#else
+static int simplefs_meta_shrink(struct shrinker *shrink,
+				struct shrink_control *sc)
+{
+	struct simplefs_meta_cache *cache =
+		container_of(shrink, struct simplefs_meta_cache, shrinker);
+
+	if (sc->nr_to_scan) {
+		spin_lock(&cache->lock);
+		simplefs_meta_prune(cache, sc->nr_to_scan);
+		spin_unlock(&cache->lock);
+	}
+	return ACCESS_ONCE(cache->nr_cached);
+}
+#endif
+
+/*
+ * Tree nodes are preloaded before the cache lock is taken, see
+ * simplefs_meta_bread().
+ */
+static void simplefs_meta_area_init(struct simplefs_meta_area *area,
+				uint64_t start, uint32_t nr)
+{
+	INIT_RADIX_TREE(&area->entries, GFP_ATOMIC);
+	INIT_LIST_HEAD(&area->dirty);
+	INIT_LIST_HEAD(&area->writeback);
+	area->start = start;
+	area->nr = nr;
+}
+
+/*
+ * Set up the inode table and bitmap areas from the super block.
+ * Nothing is read yet.
+ */
+int simplefs_meta_init(struct super_block *sb)
+{
+	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(sb);
+	struct simplefs_meta_cache *cache = &msblk->meta_cache;
+
+	spin_lock_init(&cache->lock);
+	INIT_LIST_HEAD(&cache->lru);
+	cache->max_cached = max(meta_cache_blocks, 16UL);
+	simplefs_meta_area_init(&msblk->inode_table,
+			msblk->sb.inode_block_start,
+			msblk->sb.inode_bitmap_start - msblk->sb.inode_block_start);
+	simplefs_meta_area_init(&msblk->inode_bitmap,
+			msblk->sb.inode_bitmap_start,
+			msblk->sb.block_bitmap_start - msblk->sb.inode_bitmap_start);
+	simplefs_meta_area_init(&msblk->block_bitmap,
+			msblk->sb.block_bitmap_start,
+			msblk->sb.data_block_start - msblk->sb.block_bitmap_start);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,12,0)
+	cache->shrinker.count_objects = simplefs_meta_count;
+	cache->shrinker.scan_objects = simplefs_meta_scan;
+#else
+	cache->shrinker.shrink = simplefs_meta_shrink;
+#endif
+	cache->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&cache->shrinker);
+	cache->registered = 1;
+	return 0;
+}
+
+void simplefs_meta_destroy(struct super_block *sb)
+{
+	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(sb);
+	struct simplefs_meta_cache *cache = &msblk->meta_cache;
+	struct simplefs_meta_entry *entry, *next;
+
+	if (cache->registered) {
+		unregister_shrinker(&cache->shrinker);
+		cache->registered = 0;
+		printk(KERN_INFO "simplefs: metadata cache %lu hits %lu misses\n",
+			cache->hits, cache->misses);
+	}
+	spin_lock(&cache->lock);
+	list_for_each_entry_safe(entry, next, &cache->lru, lru)
+		simplefs_meta_forget(cache, entry);
+	spin_unlock(&cache->lock);
+}
+
+/*
+ * Return block index of the area with a reference, the caller drops
+ * it with brelse(). NULL if the block can't be read.
+ */
+struct buffer_head *simplefs_meta_bread(struct super_block *sb,
+					struct simplefs_meta_area *area,
+					uint32_t index)
+{
+	struct simplefs_meta_cache *cache = &SIMPLEFS_SB(sb)->meta_cache;
+	struct simplefs_meta_entry *entry;
+	struct buffer_head *bh;
+	unsigned int ra = 0;
+	uint32_t i;
+
+	if (index >= area->nr)
+		return NULL;
+	spin_lock(&cache->lock);
+	entry = radix_tree_lookup(&area->entries, index);
+	if (entry) {
+		cache->hits++;
+		list_move_tail(&entry->lru, &cache->lru);
+		bh = entry->bh;
+		get_bh(bh);
+		spin_unlock(&cache->lock);
+		return bh;
+	}
+	cache->misses++;
+	for (i = 1; i <= SIMPLEFS_META_RA && index + i < area->nr; i++) {
+		if (!radix_tree_lookup(&area->entries, index + i))
+			ra |= 1U << i;
+	}
+	spin_unlock(&cache->lock);
+
+	for (i = 1; i <= SIMPLEFS_META_RA; i++) {
+		if (ra & (1U << i))
+			sb_breadahead(sb, area->start + index + i);
+	}
+	bh = sb_bread(sb, area->start + index);
+	if (!bh)
+		return NULL;
+	/*
+	 * Not being able to cache it doesn't stop us from using it,
+	 * simplefs_meta_dirty() writes it out itself.
+	 */
+	entry = kmalloc(sizeof(*entry), GFP_NOFS | __GFP_NOWARN);
+	if (!entry)
+		return bh;
+	if (radix_tree_preload(GFP_NOFS)) {
+		kfree(entry);
+		return bh;
+	}
+
+	spin_lock(&cache->lock);
+	entry->bh = bh;
+	entry->area = area;
+	entry->index = index;
+	INIT_LIST_HEAD(&entry->dirty);
+	INIT_LIST_HEAD(&entry->writeback);
+	if (radix_tree_insert(&area->entries, index, entry)) {
+		/* Somebody else read it in the meantime */
+		spin_unlock(&cache->lock);
+		radix_tree_preload_end();
+		kfree(entry);
+		return bh;
+	}
+	radix_tree_preload_end();
+	get_bh(bh);
+	list_add_tail(&entry->lru, &cache->lru);
+	if (++cache->nr_cached > cache->max_cached)
+		simplefs_meta_prune(cache, cache->nr_cached - cache->max_cached);
+	spin_unlock(&cache->lock);
+	return bh;
+}
+
+/*
+ * Dirty a block returned by simplefs_meta_bread(). sync_fs only writes
+ * the blocks on the dirty list of the area, one which isn't cached is
+ * written here. May sleep.
+ */
+void simplefs_meta_dirty(struct super_block *sb, struct simplefs_meta_area *area,
+			struct buffer_head *bh)
+{
+	struct simplefs_meta_cache *cache = &SIMPLEFS_SB(sb)->meta_cache;
+	struct simplefs_meta_entry *entry;
+
+	mark_buffer_dirty(bh);
+	spin_lock(&cache->lock);
+	entry = radix_tree_lookup(&area->entries, bh->b_blocknr - area->start);
+	if (entry && list_empty(&entry->dirty))
+		list_add_tail(&entry->dirty, &area->dirty);
+	spin_unlock(&cache->lock);
+	if (!entry && sync_dirty_buffer(bh)) {
+		spin_lock(&cache->lock);
+		cache->write_error = -EIO;
+		spin_unlock(&cache->lock);
+	}
+}
+
+/*
+ * Inode inode_no lives at a fixed place in the inode table, inode
+ * numbers start from 1. Returns the inode table block holding it with
+ * a reference and points *raw at the inode inside it. Only the first
+ * inode_size bytes of *raw belong to the inode.
+ */
+struct buffer_head *simplefs_inode_bread(struct super_block *sb,
+					uint64_t inode_no,
+					struct simplefs_inode **raw)
+{
+	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(sb);
+	uint32_t per_block = SIMPLEFS_INODES_PER_BLOCK(msblk);
+	struct buffer_head *bh;
+
+	if (!inode_no || inode_no > SIMPLEFS_MAX_INODES(msblk))
+		return NULL;
+	bh = simplefs_meta_bread(sb, &msblk->inode_table,
+				(inode_no - 1) / per_block);
+	if (bh)
+		*raw = (struct simplefs_inode *)(bh->b_data +
+			((inode_no - 1) % per_block) * msblk->inode_size);
+	return bh;
+}
+
+/*
+ * Start reading the inode table block of inode_no in the background
+ * unless it is cached already. Returns 1 if it is, then the inode can
+ * be read without waiting for the disk.
+ */
+int simplefs_inode_readahead(struct super_block *sb, uint64_t inode_no)
+{
+	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(sb);
+	struct simplefs_meta_cache *cache = &msblk->meta_cache;
+	uint32_t index;
+	int cached;
+
+	if (!inode_no || inode_no > SIMPLEFS_MAX_INODES(msblk))
+		return 0;
+	index = (inode_no - 1) / SIMPLEFS_INODES_PER_BLOCK(msblk);
+	spin_lock(&cache->lock);
+	cached = radix_tree_lookup(&msblk->inode_table.entries, index) != NULL;
+	spin_unlock(&cache->lock);
+	if (!cached)
+		sb_breadahead(sb, msblk->inode_table.start + index);
+	return cached;
+}
+
+/*
+ * Start writing out the cached blocks dirtied since the last call,
+ * without waiting for it. Every block goes out once however many
+ * inodes or bits in it changed.
+ */
+void simplefs_meta_write(struct super_block *sb, struct simplefs_meta_area *area)
+{
+	struct simplefs_meta_cache *cache = &SIMPLEFS_SB(sb)->meta_cache;
+	struct simplefs_meta_entry *entry;
+	struct buffer_head *bh;
+
+	spin_lock(&cache->lock);
+	while (!list_empty(&area->dirty)) {
+		entry = list_first_entry(&area->dirty,
+					struct simplefs_meta_entry, dirty);
+		list_del_init(&entry->dirty);
+		if (list_empty(&entry->writeback))
+			list_add_tail(&entry->writeback, &area->writeback);
+		bh = entry->bh;
+		get_bh(bh);
+		spin_unlock(&cache->lock);
+		write_dirty_buffer(bh, WRITE);
+		brelse(bh);
+		spin_lock(&cache->lock);
+	}
+	spin_unlock(&cache->lock);
+}
+
+/*
+ * Wait for the writes started by simplefs_meta_write(). Returns -EIO if
+ * one of them failed, or if a block written earlier failed and has left
+ * the cache since.
+ */
+int simplefs_meta_wait(struct super_block *sb, struct simplefs_meta_area *area)
+{
+	struct simplefs_meta_cache *cache = &SIMPLEFS_SB(sb)->meta_cache;
+	struct simplefs_meta_entry *entry;
+	struct buffer_head *bh;
+	int ret = 0;
+
+	spin_lock(&cache->lock);
+	while (!list_empty(&area->writeback)) {
+		entry = list_first_entry(&area->writeback,
+					struct simplefs_meta_entry, writeback);
+		list_del_init(&entry->writeback);
+		bh = entry->bh;
+		get_bh(bh);
+		spin_unlock(&cache->lock);
+		wait_on_buffer(bh);
+		if (buffer_write_io_error(bh)) {
+			clear_buffer_write_io_error(bh);
+			ret = -EIO;
+		}
+		brelse(bh);
+		spin_lock(&cache->lock);
+	}
+	if (cache->write_error) {
+		ret = cache->write_error;
+		cache->write_error = 0;
+	}
+	spin_unlock(&cache->lock);
+	return ret;
+}
+
+/* Cache and index statistics for /proc/self/mountstats */
+int simplefs_show_stats(struct seq_file *m, struct dentry *root)
+{
+	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(root->d_sb);
+	struct simplefs_meta_cache *cache = &msblk->meta_cache;
+
+	spin_lock(&cache->lock);
+	seq_printf(m, " meta_cache: cached %lu max %lu hits %lu misses %lu",
+		cache->nr_cached, cache->max_cached, cache->hits, cache->misses);
+	spin_unlock(&cache->lock);
+	seq_printf(m, " free_extents: %lu bytes", simplefs_fext_memory(msblk));
+	return 0;
+}
@@ -43,20 +43,157 @@ const int SIMPLEFS_INODESTORE_BLOCK_NUMBER = 1;
 const int SIMPLEFS_ROOTDIR_DATABLOCK_NUMBER = 2;
 
 /* The name+inode_number pair for each file in a directory.
- * This gets stored as the data for a directory */
+ * This gets stored as the data for a directory on filesystems
+ * without SIMPLEFS_FEATURE_DIR_PACKED, one record per fixed slot */
 struct simplefs_dir_record {
 	uint64_t inode_no;
 	uint8_t	 name_len;
 	char filename[SIMPLEFS_FILENAME_MAXLEN + 1];
 };
+
+/*
+ * Directory records with SIMPLEFS_FEATURE_DIR_PACKED. A record takes
+ * dir_record_len() bytes and rec_len tells where the next one starts.
+ * The records of a block cover it to its end: room left behind a
+ * record is counted in its rec_len, a record with inode_no 0 is free
+ * space. The name is not NUL terminated.
+ */
 struct simplefs_dir_record_i {
 	uint64_t inode_no;
+	uint16_t rec_len;
 	uint8_t name_len;
+	uint8_t file_type;	/*SIMPLEFS_FT_*, so readdir needn't read the inode*/
 	char filename[0];
 };
 
-#define DIR_RECORD_BASE_SIZE		(sizeof(struct simplefs_dir_record) - SIMPLEFS_FILENAME_MAXLEN)
-#define dir_record_len(dir_record)	(DIR_RECORD_BASE_SIZE + (dir_record)->name_len)
+/* file_type of a directory record, 0 in records written before it was */
+#define SIMPLEFS_FT_UNKNOWN	0
+#define SIMPLEFS_FT_REG_FILE	1
+#define SIMPLEFS_FT_DIR		2
+
+#define DIR_RECORD_BASE_SIZE		12 /*Up to filename*/
+#define DIR_RECORD_LEN(name_len)	((DIR_RECORD_BASE_SIZE + (name_len) + 7) & ~7)
+#define dir_record_len(dir_record)	DIR_RECORD_LEN((dir_record)->name_len)
+
+/* Feature bits in the super block, see features below */
+#define SIMPLEFS_FEATURE_EXTENTS	0x1 /*New files are mapped with extents*/
+#define SIMPLEFS_FEATURE_INLINE_DATA	0x2 /*256 byte inodes, small files live in them*/
+#define SIMPLEFS_FEATURE_DIR_INDEX	0x4 /*Large directories are hashed*/
+#define SIMPLEFS_FEATURE_DIR_PACKED	0x8 /*Variable length directory records*/
+/*
+ * Inodes are 128 bytes or more. Filesystems made before the inode grew
+ * have 56 byte inodes and nothing, or garbage, in features, they can't
+ * be mounted.
+ */
+#define SIMPLEFS_FEATURE_LARGE_INODE	0x10
+#define SIMPLEFS_FEATURES_SUPPORTED\
+	(SIMPLEFS_FEATURE_EXTENTS | SIMPLEFS_FEATURE_INLINE_DATA |\
+	 SIMPLEFS_FEATURE_DIR_INDEX | SIMPLEFS_FEATURE_DIR_PACKED |\
+	 SIMPLEFS_FEATURE_LARGE_INODE)
+
+/* Flags for simplefs_inode.flags */
+#define SIMPLEFS_INODE_EXTENTS		0x1 /*block_area holds an extent tree*/
+#define SIMPLEFS_INODE_INLINE		0x2 /*inline_data holds the file contents*/
+#define SIMPLEFS_INODE_INDEXED		0x4 /*Directory block is a dx root*/
+
+/*
+ * Hashed directories. The directory's block holds the root: a header
+ * and entries sorted by hash, each pointing to a leaf block of
+ * records, or with levels set to an index block laid out like the root
+ * whose entries point to the leaves. Entry 0 always has hash 0. Names
+ * are hashed with simplefs_name_hash().
+ */
+#define SIMPLEFS_DX_MAGIC		0x5344
+/* Index blocks between the root and the leaves */
+#define SIMPLEFS_DX_MAX_LEVELS		1
+
+struct simplefs_dx_root {
+	uint16_t magic;
+	uint16_t count;
+	uint16_t limit;
+	uint16_t levels;	/*Root only, index levels below it*/
+};
+
+/*
+ * Names sharing a hash start in the leaf before the one of an entry
+ * with this flag and go on in it. Set when a leaf whose records all
+ * have the same hash is split.
+ */
+#define SIMPLEFS_DX_CONT		0x1
+
+struct simplefs_dx_entry {
+	uint32_t hash;		/*Lowest hash below this entry*/
+	uint32_t flags;
+	uint64_t block;		/*Directory block of the leaf or index block*/
+};
+
+#define DX_FIRST_ENTRY(root)	((struct simplefs_dx_entry *)((root) + 1))
+#define DX_ROOT_LIMIT(block_size)\
+	(((block_size) - sizeof(struct simplefs_dx_root))\
+	 	/ sizeof(struct simplefs_dx_entry))
+
+/*
+ * Extent tree. Each node, the root in the inode's block_area as well
+ * as the tree blocks, starts with a header followed by entries.
+ * Leaves (depth 0) hold extents, the other nodes hold index entries
+ * pointing to the next level. Both entries are 16 bytes and start with
+ * the first logical block they cover.
+ */
+#define SIMPLEFS_EXT_MAGIC		0x5346
+#define SIMPLEFS_EXT_MAX_DEPTH		4
+/* An extent never spans more than one block group */
+#define SIMPLEFS_EXT_MAX_LEN		(SIMPLEFS_DEFAULT_BLOCK_SIZE * 8)
+#define SIMPLEFS_EXT_MAX_LBLK		0xffffffffULL
+/*
+ * Set in the length of an extent whose blocks are allocated but have
+ * never been written, reads see zeroes.
+ */
+#define SIMPLEFS_EXT_UNWRITTEN		0x80000000
+
+struct simplefs_extent_header {
+	uint16_t magic;
+	uint16_t entries;
+	uint16_t max;
+	uint16_t depth;
+};
+
+struct simplefs_extent {
+	uint32_t logical;	/*First file block*/
+	uint32_t length;	/*Number of blocks, | SIMPLEFS_EXT_UNWRITTEN*/
+	uint64_t physical;	/*First disk block*/
+};
+
+struct simplefs_extent_idx {
+	uint32_t logical;	/*First file block covered by the child*/
+	uint32_t unused;
+	uint64_t block;		/*Disk block of the child node*/
+};
+
+#define EXT_FIRST_EXTENT(hdr)	((struct simplefs_extent *)((hdr) + 1))
+#define EXT_FIRST_INDEX(hdr)	((struct simplefs_extent_idx *)((hdr) + 1))
+#define EXT_BLOCK_MAX(block_size)\
+	(((block_size) - sizeof(struct simplefs_extent_header))\
+	 	/ sizeof(struct simplefs_extent))
+
+#define SIMPLEFS_INODE_BLOCK_AREA	64
+
+/*
+ * block_area of a file mapped without extents. Past its indirect
+ * block, a file is mapped through a double and then a triple indirect
+ * block, every table holding block_size / 8 block numbers. 0 while the
+ * file doesn't reach that far, which is how block_area of such a file
+ * always read before.
+ */
+struct simplefs_block_map {
+	uint64_t dind_block_number;
+	uint64_t tind_block_number;
+};
+#define SIMPLEFS_MAP_DEPTH	3 /*Tables on the way to a triple indirect block*/
+/* Bytes of file data an inline inode can hold */
+#define SIMPLEFS_INODE_INLINE_MAX	192
+#define SIMPLEFS_EXT_ROOT_MAX\
+	((SIMPLEFS_INODE_BLOCK_AREA - sizeof(struct simplefs_extent_header))\
+	 	/ sizeof(struct simplefs_extent))
 
 struct simplefs_inode {
 	uint64_t  mode;
@@ -64,21 +201,28 @@ struct simplefs_inode {
 	uint64_t data_block_number;
 	uint64_t c_time;
 	uint64_t m_time;
-	uint64_t indirect_block_number; /*All indirect blocks are recorded here*/
+	uint64_t indirect_block_number; /*Maps blocks 1 to block_size / 8*/
 
 	union {
 		uint64_t file_size;
 		uint64_t dir_children_count;
 	};
+	uint32_t flags;
+	uint32_t dir_blocks; /*Size of a directory in blocks, 0 is read as 1*/
+	/*
+	 * Root of the extent tree for SIMPLEFS_INODE_EXTENTS files, the
+	 * file contents for SIMPLEFS_INODE_INLINE ones, a struct
+	 * simplefs_block_map otherwise.
+	 * Only the block_area part is on disk without the inline data
+	 * feature.
+	 */
+	union {
+		char block_area[SIMPLEFS_INODE_BLOCK_AREA];
+		char inline_data[SIMPLEFS_INODE_INLINE_MAX];
+	};
 };
 
 
-const int SIMPLEFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED = 64;
-/* min (
-		SIMPLEFS_DEFAULT_BLOCK_SIZE / sizeof(struct simplefs_inode),
-		sizeof(uint64_t) //The free_blocks tracker in the sb 
- 	); */
-
 /* FIXME: Move the struct to its own file and not expose the members
  * Always access using the simplefs_sb_* functions and 
  * do not access the members directly 
@@ -100,8 +244,9 @@ struct simplefs_super_block {
 		char 	char_version[4];
 		uint32_t int_version; /*The last bit on=LITTLE_ENDIAN, off=BIG_ENDIAN*/
 	};
+	uint64_t features; /*SIMPLEFS_FEATURE_* bits*/
 
-	char padding[SIMPLEFS_DEFAULT_BLOCK_SIZE - (9 * sizeof(uint64_t))];
+	char padding[SIMPLEFS_DEFAULT_BLOCK_SIZE - (10 * sizeof(uint64_t))];
 };
 
 struct simplefs_super_block_inode_info {
@@ -111,6 +256,8 @@ struct simplefs_super_block_inode_info {
 
 
 #define SIMPLEFS_INODE_SIZE	(sizeof(struct simplefs_inode))
+/* On disk inode size of filesystems without SIMPLEFS_FEATURE_INLINE_DATA */
+#define SIMPLEFS_OLD_INODE_SIZE	128
 
 #define cpu_super_to(endianess,sb)\
 	({\
@@ -124,6 +271,7 @@ struct simplefs_super_block_inode_info {
 	                (sb)->block_bitmap_start = cpu_to_##endianess((sb)->block_bitmap_start,64);\
 	                (sb)->data_block_start = cpu_to_##endianess((sb)->data_block_start,64);\
 	                (sb)->block_size = cpu_to_##endianess((sb)->block_size,32);\
+	                (sb)->features = cpu_to_##endianess((sb)->features,64);\
 	})
 
 #define super_to_cpu(endianess,sb)\
@@ -137,6 +285,7 @@ struct simplefs_super_block_inode_info {
 	                (sb)->block_bitmap_start = endianess##_to_cpu((sb)->block_bitmap_start,64);\
 	                (sb)->data_block_start = endianess##_to_cpu((sb)->data_block_start,64);\
 	                (sb)->block_size = endianess##_to_cpu((sb)->block_size,32);\
+	                (sb)->features = endianess##_to_cpu((sb)->features,64);\
 	 })
 
 #define cpu_inode_to(endianess,inode)\
@@ -147,6 +296,7 @@ struct simplefs_super_block_inode_info {
                 (inode)->file_size = cpu_to_##endianess((inode)->file_size,64);\
 				(inode)->c_time = cpu_to_##endianess((inode)->c_time,64);\
 				(inode)->m_time = cpu_to_##endianess((inode)->m_time,64);\
+				(inode)->flags = cpu_to_##endianess((inode)->flags,32);\
 	 })
 
 #define inode_to_cpu(endianess,inode)\
@@ -157,5 +307,6 @@ struct simplefs_super_block_inode_info {
 	        (inode)->file_size = endianess_to_cpu((inode)->file_size,64);\
 			(inode)->c_time = endianess_to_cpu((inode)->c_time,64);\
 			(inode)->m_time = endianess_to_cpu((inode)->m_time,64);\
+			(inode)->flags = endianess_to_cpu((inode)->flags,32);\
 	 })
 #endif
@@ -4,34 +4,126 @@
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/rwsem.h>
+#include <linux/percpu_counter.h>
+#include <linux/rbtree.h>
+#include <linux/radix-tree.h>
+#include <linux/shrinker.h>
 #include "simple.h"
 
+/*
+ * A run of metadata blocks on disk, the inode table or one of the
+ * bitmaps. Blocks are read on first use and cached, see meta.c.
+ */
+struct simplefs_meta_area {
+	struct radix_tree_root entries;	/* Cached blocks by index in the area */
+	struct list_head dirty;		/* Cached entries dirtied since meta_write */
+	struct list_head writeback;	/* Written by meta_write, for meta_wait */
+	uint64_t start;			/* First disk block */
+	uint32_t nr;
+};
+
+struct simplefs_meta_cache {
+	spinlock_t lock;		/* Protects everything below and the area lists */
+	struct list_head lru;		/* Least recently used first */
+	unsigned long nr_cached;
+	unsigned long max_cached;
+	unsigned long hits;
+	unsigned long misses;
+	int write_error;		/* Of an entry which went, for meta_wait */
+	struct shrinker shrinker;
+	int registered;
+};
+
+/*
+ * In memory state of a block group. A group covers the blocks tracked
+ * by one block bitmap buffer, block_size * 8 of them. Allocations in
+ * different groups don't share any lock.
+ *
+ * A group is loaded, its bitmap read and counted, the first time an
+ * allocation or a free gets to it. Until then only loaded is valid.
+ * The bitmap block isn't pinned, it is looked up in the metadata cache
+ * each time and can leave it like any other metadata block.
+ */
+struct simple_fs_group_i {
+	spinlock_t lock;		/* Protects the bitmap and the fields below */
+	int loaded;
+	uint32_t bitmap_len;		/* Usable bytes in its block_bitmap block */
+	uint32_t free_blocks;
+	int32_t last_alloc;		/* Bit after the last allocation */
+	/* Free runs of the bitmap, see free_extents.c */
+	struct rb_root free_extents;
+	uint32_t nr_free_extents;
+	int indexed;			/* 0 when free_extents is not in use */
+	uint32_t unindexed_frees;	/* Since the last rebuild attempt */
+};
+
+/* Inode numbers each cpu keeps at hand, see ialloc.c */
+#define SIMPLEFS_INO_BATCH	16
+
+struct simplefs_ino_batch {
+	int nr;
+	uint64_t ino[SIMPLEFS_INO_BATCH];
+};
+
+/* Mount options */
+#define SIMPLEFS_MOUNT_DELALLOC	0x1 /*Allocate blocks at writeback, default*/
+
+#define SIMPLEFS_BLOCKS_PER_GROUP(msblk)	((msblk)->sb.block_size << 3)
+#define SIMPLEFS_INODES_PER_BLOCK(msblk)\
+	((msblk)->sb.block_size / (msblk)->inode_size)
+/* Inode numbers go from 1 to this one */
+#define SIMPLEFS_MAX_INODES(msblk)\
+	((uint64_t)(msblk)->inode_table.nr * SIMPLEFS_INODES_PER_BLOCK(msblk))
+
 struct simple_fs_sb_i {
 	struct simplefs_super_block sb;
 	/*
-	 * These 3 are array of pointers
-	 * for meta-data. We need to figure
-	 * how much to stuff in memory for larger bitmaps.
-	 * These arrays are null terminated.
-	 *
-	 * Perhaps we could do that by breaking up the blocks
-	 * into groups and then work on each group. Well
-	 * that's another story we'll work on it later. right now
-	 * let's try to get this shit going.
+	 * Meta-data blocks, read in as they are needed rather than
+	 * all of them at mount.
 	 * */
-	struct buffer_head **inode_table;
-	struct buffer_head **inode_bitmap;
-	struct buffer_head **block_bitmap;
-	struct kmem_cache *inode_cachep;
+	struct simplefs_meta_area inode_table;
+	struct simplefs_meta_area inode_bitmap;
+	struct simplefs_meta_area block_bitmap;
+	struct simplefs_meta_cache meta_cache;
+	uint32_t inode_size;	/* On disk, see SIMPLEFS_OLD_INODE_SIZE */
+	/* Inode number allocation */
+	struct mutex ino_mutex;		/* Protects the inode bitmap and ino_hint */
+	uint64_t ino_hint;		/* Bit to start looking from */
+	struct simplefs_ino_batch __percpu *ino_batch;
+	/*
+	 * The block bitmap is worked on in groups, one group per
+	 * block_bitmap buffer. See struct simple_fs_group_i.
+	 */
+	struct simple_fs_group_i *groups;
+	uint32_t nr_groups;
+	atomic_t unloaded_groups;
+	/* Free blocks in the loaded groups */
+	struct percpu_counter free_blocks_counter;
+	/* Blocks reserved by delayed allocation but not allocated yet */
+	struct percpu_counter dirty_blocks_counter;
+	atomic_long_t free_extent_nodes; /*Nodes in all the free extent indexes*/
+	unsigned long mount_opts; /*SIMPLEFS_MOUNT_* */
 	struct mutex 		sb_mutex;
+	spinlock_t		sb_lock; /* Protects the counters in sb */
 };
 
+/*
+ * In memory inode. Only what the VFS inode doesn't already keep is
+ * taken from the on disk inode, decoded to cpu order. The contents of
+ * an inline file stay in the inode table block.
+ */
 struct simple_fs_inode_i {
 	struct inode vfs_inode;
-	struct simplefs_inode inode;
-	/*
-	 * Add more members as and when required.
-	 * */
-	struct buffer_head *indirect_block;
+	uint64_t data_block_number;
+	uint64_t indirect_block_number;
+	uint64_t dir_children_count;
+	uint64_t alloc_goal; /*Block to start from when the file has none, 0 if unknown*/
+	uint32_t flags; /*SIMPLEFS_INODE_* */
+	uint32_t home_group; /*Group where data allocations start*/
+	atomic_t da_reserved; /*Delayed blocks not allocated yet*/
+	struct rw_semaphore map_sem; /*Protects the block map and the extent tree*/
+	char block_area[SIMPLEFS_INODE_BLOCK_AREA]; /*Extent root, as it is on disk*/
 };
 #endif
@@ -2,8 +2,74 @@
 #define SIMPLEFS_LIB_H
 #ifndef __KERNEL__
 #include <sys/types.h>
-extern int32_t alloc_bmap(char *buffer,int32_t bmap_len);
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
 #else
-extern int32_t alloc_bmap(char *buffer,int32_t bmap_len);
+#include <linux/types.h>
+#include <linux/string.h>
+#include <linux/bitops.h>
+#include <asm/byteorder.h>
 #endif /*__KERNEL__*/
+
+/*
+ * Bitmap helpers shared by mkfs and the kernel module.
+ * bmap_len is always in bytes, bit numbers start from 0.
+ */
+extern int32_t alloc_bmap(char *buffer,int32_t bmap_len);
+extern int32_t alloc_bmap_hint(char *buffer,int32_t bmap_len,int32_t *hint);
+extern int32_t alloc_bmap_range(char *buffer,int32_t bmap_len,
+				int32_t goal,int32_t count);
+extern int32_t find_bmap_zero(const char *buffer,int32_t bmap_len,int32_t start);
+extern int32_t find_bmap_one(const char *buffer,int32_t bmap_len,int32_t start);
+extern int free_bmap(char *buffer,int32_t bmap_len,int loc);
+/*
+ * Hash of a directory entry name. It is stored on disk in the
+ * directory index, so it must never change.
+ */
+extern uint32_t simplefs_name_hash(const char *name,int len);
+
+/*
+ * Compare two names of len bytes a word at a time. Only bytes of the
+ * names are read, the last word overlaps the one before it.
+ */
+static inline int simplefs_name_eq(const char *a,const char *b,int len)
+{
+	uint64_t x, y;
+	uint32_t u, v;
+	int i;
+
+	if (len >= 8) {
+		for (i = 0; i + 8 < len; i += 8) {
+			memcpy(&x, a + i, 8);
+			memcpy(&y, b + i, 8);
+			if (x != y)
+				return 0;
+		}
+		memcpy(&x, a + len - 8, 8);
+		memcpy(&y, b + len - 8, 8);
+		return x == y;
+	}
+	if (len >= 4) {
+		memcpy(&u, a, 4);
+		memcpy(&v, b, 4);
+		if (u != v)
+			return 0;
+		memcpy(&u, a + len - 4, 4);
+		memcpy(&v, b + len - 4, 4);
+		return u == v;
+	}
+	for (i = 0; i < len; i++)
+		if (a[i] != b[i])
+			return 0;
+	return 1;
+}
+
+/*
+ * Find name among the packed directory records in the first end bytes
+ * of a directory block. Returns the offset of its record, -1 if it is
+ * not there or -2 if the records don't chain up.
+ */
+extern int32_t simplefs_dirblock_find(const char *block,uint32_t end,
+				const char *name,int len);
 #endif /*SIMPLEFS_LIB_H*/
@@ -1,61 +1,188 @@
 #include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/percpu_counter.h>
+#include <linux/pagemap.h>
+#include <linux/writeback.h>
+#include <linux/mpage.h>
+#include <linux/blkdev.h>
+#include <linux/highmem.h>
 #include "super.h"
+#include "simplefs-lib.h"
 
 
-static void simplefs_sync_metadata_buffer(struct bufffer_head **bh_table)
+/*
+ * Copy the in memory super block into its disk block and start writing
+ * it. The counters in msblk->sb change under sb_lock only, nothing has
+ * to be held around the create or the remove that changes them.
+ */
+static struct buffer_head *simplefs_write_super(struct super_block *sb)
 {
-	struct buffer_head **walker = *bh_table;
-	while(walker) {	
-		struct buffer_head *bh = *walker;
-		do
-		{
-			if(!buffer_uptodate(bh))
-				sync_dirty_buffer(bh);
-			bh=bh->b_this_page;
-		}while(bh->b_this_page != *walker);
-		walker++;
-	}
+	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(sb);
+	struct simplefs_super_block *disk_sb;
+	struct buffer_head *bh;
+
+	bh = sb_bread(sb, SIMPLEFS_SUPERBLOCK_BLOCK_NUMBER);
+	if (!bh)
+		return NULL;
+	disk_sb = (struct simplefs_super_block *)bh->b_data;
+	lock_buffer(bh);
+	spin_lock(&msblk->sb_lock);
+	memcpy(disk_sb, &msblk->sb, sizeof(*disk_sb));
+	spin_unlock(&msblk->sb_lock);
+	/* Only right once every group has counted its bitmap */
+	if (!atomic_read(&msblk->unloaded_groups))
+		disk_sb->free_blocks = percpu_counter_sum_positive(
+					&msblk->free_blocks_counter);
+	if (!(disk_sb->char_version[0] & SIMPLEFS_ENDIANESS_LITTLE))
+		cpu_super_to(le, disk_sb);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	write_dirty_buffer(bh, WRITE);
+	return bh;
 }
-void simplefs_sync_metadata(struct super_block *sb)
+
+/*
+ * Write out the dirty inode table and bitmap blocks and the super block.
+ * All of the writes are started before waiting on any of them.
+ */
+int simplefs_sync_metadata(struct super_block *sb, int wait)
 {
 	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(sb);
+	struct buffer_head *bh;
+	int ret, err;
+
 	/*
 	 * Start with inodes.
 	 */
-	simplefs_sync_metadata_buffer(msblk->inode_table);
-	simplefs_sync_metadata_buffer(msblk->inode_bitmap);
-	simeplfs_sync_metadata_buffer(msblk->block_bitmap);
+	simplefs_meta_write(sb, &msblk->inode_table);
+	simplefs_meta_write(sb, &msblk->inode_bitmap);
+	simplefs_meta_write(sb, &msblk->block_bitmap);
+	bh = simplefs_write_super(sb);
+	if (!wait) {
+		brelse(bh);
+		return 0;
+	}
+	ret = simplefs_meta_wait(sb, &msblk->inode_table);
+	err = simplefs_meta_wait(sb, &msblk->inode_bitmap);
+	if (!ret)
+		ret = err;
+	err = simplefs_meta_wait(sb, &msblk->block_bitmap);
+	if (!ret)
+		ret = err;
+	if (!bh)
+		return ret ? ret : -EIO;
+	wait_on_buffer(bh);
+	if (!ret && !buffer_uptodate(bh))
+		ret = -EIO;
+	brelse(bh);
+	return ret;
+}
+
+static int simplefs_sync_fs(struct super_block *sb, int wait)
+{
+	return simplefs_sync_metadata(sb, wait);
+}
+
+static struct kmem_cache *simplefs_inode_cachep;
+
+static void simplefs_inode_init_once(void *obj)
+{
+	struct simple_fs_inode_i *inode = obj;
+
+	init_rwsem(&inode->map_sem);
+	inode_init_once(&inode->vfs_inode);
+}
+
+/*
+ * One inode cache for all mounts, set up when the module is loaded.
+ */
+int simplefs_init_inodecache(void)
+{
+	simplefs_inode_cachep = kmem_cache_create("simplefs_inode_cache",
+				sizeof(struct simple_fs_inode_i), 0,
+				SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD,
+				simplefs_inode_init_once);
+	return simplefs_inode_cachep ? 0 : -ENOMEM;
+}
+
+void simplefs_destroy_inodecache(void)
+{
+	/* Inodes freed through call_rcu have to be gone first */
+	rcu_barrier();
+	kmem_cache_destroy(simplefs_inode_cachep);
 }
 
 static struct inode* simplefs_alloc_inode(struct super_block *sb) 
 {
-	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(sb);
 	struct simple_fs_inode_i *inode = 
-			kmem_cache_alloc(msblk->inode_cachep,GFP_KERNEL);
+			kmem_cache_alloc(simplefs_inode_cachep,GFP_KERNEL);
 	if(!inode)
 		return NULL;
+	inode->data_block_number = 0;
+	inode->indirect_block_number = 0;
+	inode->dir_children_count = 0;
+	inode->alloc_goal = 0;
+	inode->flags = 0;
+	inode->home_group = (uint32_t)-1; /*Picked on first allocation*/
+	atomic_set(&inode->da_reserved, 0);
+	memset(inode->block_area, 0, SIMPLEFS_INODE_BLOCK_AREA);
 	return &inode->vfs_inode;
 }
 
+static void simplefs_i_callback(struct rcu_head *head)
+{
+	struct inode *vfs_inode = container_of(head, struct inode, i_rcu);
+
+	kmem_cache_free(simplefs_inode_cachep, SIMPLEFS_INODE(vfs_inode));
+}
+
 static void simplefs_destroy_inode(struct inode *vfs_inode) 
 {
-	struct simple_fs_inode_i *inode = SIMPLEFS_INODE(vfs_inode);
-	struct simple_fs_sb_i *sb = SIMPLEFS_SB(vfs_inode->i_sb);
-	if (inode->indirect_block) {
-		if(!buffer_uptodate(inode->indirect_block))
-			sync_dirty_buffer(inode->indirect_block);
-		bforget(inode->indirect_block);
-	}
-	kmem_cache_free(sb->inode_cachep,inode);
+	call_rcu(&vfs_inode->i_rcu, simplefs_i_callback);
 }
 
+/*
+ * Called by kill_block_super() once the inodes are synced and evicted,
+ * before the block device goes away.
+ */
 static void simplefs_put_super(struct super_block *sb) 
 {
 	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(sb);
-	if(msblk->inode_cachep)
-		kmem_cache_destroy(msblk->inode_cachep);	
+
+	simplefs_ialloc_destroy(sb);
+	simplefs_sync_metadata(sb, 1);
+	simplefs_destroy_groups(sb);
+	simplefs_meta_destroy(sb);
 	kfree(msblk);
-	sb->s_private = NULL;
+	sb->s_fs_info = NULL;
+}
+
+/*
+ * Fill the on disk inode from the in memory one. The inline data of an
+ * inline file is left alone, it is only ever written in place.
+ */
+void simplefs_inode_to_disk(struct inode *vfs_inode, struct simplefs_inode *disk)
+{
+	struct simple_fs_inode_i *minode = SIMPLEFS_INODE(vfs_inode);
+
+	disk->mode = cpu_to_le64(vfs_inode->i_mode);
+	disk->inode_no = cpu_to_le64(vfs_inode->i_ino);
+	disk->data_block_number = cpu_to_le64(minode->data_block_number);
+	disk->c_time = cpu_to_le64(timespec_to_ns(&vfs_inode->i_ctime));
+	disk->m_time = cpu_to_le64(timespec_to_ns(&vfs_inode->i_mtime));
+	disk->indirect_block_number =
+		cpu_to_le64(minode->indirect_block_number);
+	if (S_ISDIR(vfs_inode->i_mode)) {
+		disk->dir_children_count =
+			cpu_to_le64(minode->dir_children_count);
+		disk->dir_blocks = cpu_to_le32(i_size_read(vfs_inode) >>
+						vfs_inode->i_blkbits);
+	} else
+		disk->file_size = cpu_to_le64(i_size_read(vfs_inode));
+	disk->flags = cpu_to_le32(minode->flags);
+	if (!(minode->flags & SIMPLEFS_INODE_INLINE))
+		memcpy(disk->block_area, minode->block_area,
+			SIMPLEFS_INODE_BLOCK_AREA);
 }
 
 static int simplefs_write_inode(struct inode *vfs_inode, struct writeback_control *wbc) 
@@ -63,141 +190,426 @@ static int simplefs_write_inode(struct inode *vfs_inode, struct writeback_contro
 	/*
 	 * We just need to write the inode here not it's pages.
 	 */
-	struct simple_fs_inode_i *minode = SIMPLEFS_INODE(vfs_inode);
-	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(vfs_inode->i_sb);
-	int inodes_per_block = SIMPLEFS_INODE_SIZE/msblk->sb.block_size;
+	struct simplefs_inode *disk_inode;
 
 	/*
 	 * Find the inode table where we need to write this inode.
 	 */
-	struct buffer_head *inode_table = msblk->inode_table[(minode->inode.inode_no - 1)/inodes_per_block];
-	struct simplefs_inode *disk_inode =
-			(struct simplefs_inode*)(inode_table->b_data + (minode->inode.inode_no - 1) % inodes_per_block);
-	
-	minode->inode.m_time = timespec_to_ns(vfs_inode.m_time);
-	minode->inode.m_time = cpu_to_le64(minode->inode.m_time);
-	
-	if(!(vfs_inode->i_mode & S_IFDIR)) {
-		minode->inode.file_size = i_size_read(vfs_inode);
-		minode->inode.file_size = cpu_to_le64(minode->inode.file_size);
-	}
-	
-	memcpy(disk_inode,&minode->inode,sizeof(struct simplefs_inode));
-	mark_buffer_dirty(inode_table);
-	if(wbc->sync_mode == WB_SYNC_ALL) {
-		SFSDBG("[SFS] Writeback control was to sync all in %s \n",__FUNCTION__);		
-		sync_dirty_buffer(inode_table);
-	}
+	struct buffer_head *inode_table = simplefs_inode_bread(vfs_inode->i_sb,
+			vfs_inode->i_ino, &disk_inode);
+	if (!inode_table)
+		return -EIO;
+
+	down_read(&SIMPLEFS_INODE(vfs_inode)->map_sem);
+	/* Other inodes of the table block may be changing too */
+	lock_buffer(inode_table);
+	simplefs_inode_to_disk(vfs_inode, disk_inode);
+	unlock_buffer(inode_table);
+	up_read(&SIMPLEFS_INODE(vfs_inode)->map_sem);
 	/*
-	 * Perhaps we should sync dirty buffer here,
-	 * but let's see how far we can go. The inode
-	 * may actually not be written if we don't force
-	 * sync and let the flush thread do it for us.
+	 * Only the inode table block is dirtied here, even for
+	 * WB_SYNC_ALL. sync_fs writes each dirty table block once
+	 * whatever number of its inodes changed, fsync writes the
+	 * one block of its inode.
 	 */
-	SFSDBG("Not syncing in %s\n",__FUNCTION__);
+	simplefs_meta_dirty(vfs_inode->i_sb,
+			&SIMPLEFS_SB(vfs_inode->i_sb)->inode_table, inode_table);
+	brelse(inode_table);
+	return 0;
 }
 
-static int allocate_data_blocks(struct inode *vfs_inode,int nr_blocks)
+/*
+ * The data, the file's tree and indirect blocks, which are dirtied with
+ * mark_buffer_dirty_inode(), and write_inode go through the generic
+ * fsync. write_inode leaves the inode in its inode table block, and new
+ * blocks are only marked in the shared block bitmap, fsync has to get
+ * those to disk itself. The cache flush goes last, after all of them.
+ */
+int simplefs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 {
-	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(vfs_inode->i_sb);
-	struct simple_fs_inode_i *minode = SIMPLEFS_INODE(vfs_inode);
-	struct buffer_head *sb_buffer_bitmap = NULL;
-	char *bitmap_buffer = NULL;
-	int block_start = 0,block_no = 0;
-	int bitmap_index = 0;
-	int blocks_alloced = 0;
-	int buffer_offset = 0; /*How many b_this_page has been done on a single bh*/
-	int block_start_buffer_offset = 0;
-	int block_start_bitmap_index = 0;
-	if(!nr_blocks)
+	struct inode *vfs_inode = file->f_mapping->host;
+	struct super_block *sb = vfs_inode->i_sb;
+	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(sb);
+	struct simplefs_inode *disk_inode;
+	struct buffer_head *bh;
+	int ret;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,16,0)
+	ret = __generic_file_fsync(file, start, end, datasync);
+#else
+	ret = generic_file_fsync(file, start, end, datasync);
+#endif
+	if (ret)
+		return ret;
+	bh = simplefs_inode_bread(sb, vfs_inode->i_ino, &disk_inode);
+	if (!bh)
+		return -EIO;
+	if (buffer_dirty(bh))
+		ret = sync_dirty_buffer(bh);
+	brelse(bh);
+	if (ret)
+		return ret;
+	simplefs_meta_write(sb, &msblk->block_bitmap);
+	ret = simplefs_meta_wait(sb, &msblk->block_bitmap);
+	if (ret)
+		return ret;
+	return blkdev_issue_flush(sb->s_bdev, GFP_KERNEL, NULL);
+}
+
+/*
+ * Tree and indirect blocks of the file may still be on its buffer
+ * list, see simplefs_fsync().
+ */
+static void simplefs_evict_inode(struct inode *vfs_inode)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0)
+	truncate_inode_pages_final(&vfs_inode->i_data);
+#else
+	truncate_inode_pages(&vfs_inode->i_data, 0);
+#endif
+	invalidate_inode_buffers(vfs_inode);
+	clear_inode(vfs_inode);
+}
+
+/*
+ * Number of blocks tracked by a group, the last group may be shorter
+ * if the device doesn't fill up its bitmap block.
+ */
+static inline uint32_t simplefs_group_nr_blocks(struct simple_fs_sb_i *msblk,
+						uint32_t group)
+{
+	uint64_t first = (uint64_t)group * SIMPLEFS_BLOCKS_PER_GROUP(msblk);
+
+	return min_t(uint64_t, msblk->sb.nr_blocks - first,
+			SIMPLEFS_BLOCKS_PER_GROUP(msblk));
+}
+
+/*
+ * Set up one group per block bitmap buffer. Called at mount, the
+ * bitmaps themselves are only read when a group is first used, see
+ * simplefs_load_group().
+ */
+int simplefs_init_groups(struct super_block *sb)
+{
+	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(sb);
+	uint32_t i;
+
+	msblk->nr_groups = DIV_ROUND_UP(msblk->sb.nr_blocks,
+					SIMPLEFS_BLOCKS_PER_GROUP(msblk));
+	if (msblk->nr_groups > msblk->block_bitmap.nr)
+		return -EIO;
+	msblk->groups = kcalloc(msblk->nr_groups,
+				sizeof(struct simple_fs_group_i), GFP_KERNEL);
+	if (!msblk->groups)
+		return -ENOMEM;
+	for (i = 0; i < msblk->nr_groups; i++)
+		spin_lock_init(&msblk->groups[i].lock);
+	atomic_set(&msblk->unloaded_groups, msblk->nr_groups);
+	atomic_long_set(&msblk->free_extent_nodes, 0);
+	if (percpu_counter_init(&msblk->free_blocks_counter, 0))
+		goto fail_counter;
+	if (percpu_counter_init(&msblk->dirty_blocks_counter, 0))
+		goto fail_dirty_counter;
+	return 0;
+fail_dirty_counter:
+	percpu_counter_destroy(&msblk->free_blocks_counter);
+fail_counter:
+	kfree(msblk->groups);
+	msblk->groups = NULL;
+	return -ENOMEM;
+}
+
+void simplefs_destroy_groups(struct super_block *sb)
+{
+	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(sb);
+	uint32_t i;
+
+	if (!msblk->groups)
+		return;
+	printk(KERN_INFO "simplefs: %u of %u groups loaded, %lu bytes for free extents\n",
+		msblk->nr_groups - atomic_read(&msblk->unloaded_groups),
+		msblk->nr_groups, simplefs_fext_memory(msblk));
+	for (i = 0; i < msblk->nr_groups; i++) {
+		struct simple_fs_group_i *group = &msblk->groups[i];
+
+		if (group->loaded)
+			simplefs_fext_drop(msblk, group);
+	}
+	percpu_counter_destroy(&msblk->free_blocks_counter);
+	percpu_counter_destroy(&msblk->dirty_blocks_counter);
+	kfree(msblk->groups);
+	msblk->groups = NULL;
+}
+
+/*
+ * The bitmap block of group nr with a reference. It is only kept in
+ * the metadata cache, loaded groups don't pin their bitmaps.
+ */
+static inline struct buffer_head *simplefs_group_bitmap(struct super_block *sb,
+							uint32_t nr)
+{
+	return simplefs_meta_bread(sb, &SIMPLEFS_SB(sb)->block_bitmap, nr);
+}
+
+/*
+ * Read in the bitmap of a group and count its free blocks. The free
+ * counts are taken from the bitmap itself so they are right even if
+ * the sb free_blocks isn't.
+ */
+static int simplefs_load_group(struct super_block *sb, uint32_t nr)
+{
+	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(sb);
+	struct simple_fs_group_i *group = &msblk->groups[nr];
+	struct buffer_head *bh;
+
+	if (likely(ACCESS_ONCE(group->loaded))) {
+		smp_rmb(); /*Pairs with the smp_wmb() below*/
 		return 0;
+	}
+	bh = simplefs_group_bitmap(sb, nr);
+	if (!bh)
+		return -EIO;
 	mutex_lock(&msblk->sb_mutex);
-new_bitmap_buffer:
-		sb_buffer_bitmap = msblk->block_bitmap[bitmap_index];
-		if(!sb_buffer_bitmap)
-				goto out_failed;
-allocate_block:
-		bitmap_buffer = sb_buffer_bitmap->b_data;
-		if( nr_blocks && 
-				(block_no = 
-					alloc_bmap(bitmap_buffer,sb_buffer_bitmap->b_size)) < 0) {
-			sb_buffer_bitmap = sb_buffer_bitmap->b_this_page;
-			if(sb_buffer_bitmap == mbslk->block_bitmap[bitmap_index]) {
-				bitmap_index++; /*Move to next buffer head in the array*/
-				buffer_offset = 0;
-				goto new_bitmap_buffer;
-			}
-			else 
-				buffer_offset++;
-			goto allocate_block;
-		}
-		else if(block_no >= 0) {
-			nr_blocks--;
-			blocks_alloced++;
-			if(!block_start) {
-				block_start = block_no + 
-						(((sb_buffer_bitmap->b_size * buffer_offset) 
-										+ (PAGE_SIZE*bitmap_index)) << 3);
-				block_start_buffer_offset = buffer_offset;
-				block_start_bitmap_index = bitmap_index;
-			}
-			if(buffer_uptodate(sb_buffer_bitmap))
-				mark_buffer_dirty(sb_buffer_bitmap);
-			block_no = -1;
-			if(nr_blocks)
-				goto allocate_block;
-		}
-	simplefs_sync_metadata(sb);
+	if (group->loaded)
+		goto out;
+	/*
+	 * Only whole bytes of the bitmap are handed to the allocator
+	 * so a few trailing blocks of a short last group are never used.
+	 */
+	group->bitmap_len = simplefs_group_nr_blocks(msblk, nr) >> 3;
+	group->free_blocks = (group->bitmap_len << 3) -
+			memweight(bh->b_data, group->bitmap_len);
+	group->last_alloc = 0;
+	/* Without an index the group just scans its bitmap */
+	simplefs_fext_build(msblk, group, bh->b_data);
+	percpu_counter_add(&msblk->free_blocks_counter, group->free_blocks);
+	smp_wmb();
+	group->loaded = 1;
+	atomic_dec(&msblk->unloaded_groups);
+out:
 	mutex_unlock(&msblk->sb_mutex);
-	return block_start; /*Return starting block number of the allocated blocks*/
-out_failed:
-	if(blocks_alloced) {
-		/*
-		 * Get the starting buffer head from where allocations
-		 * were started.
-		 */
-		sb_buffer_bitmap = msblk->block_bitmap[block_start_bitmap_index];
-		/*
-		 * Get the starting block number relative to the buffer head.
-		 */
-		block_no = block_start - ((
-				(sb_buffer_bitmap->b_size * block_start_buffer_offset)
-					+(PAGE_SIZE * block_start_bitmap_index))) * 8;		
-		/*
-		 * Move to the correct buffer head within the page.
-		 */
-		while(block_start_buffer_offset) {
-			sb_buffer_bitmap = sb_buffer_bitmap->b_this_page;
-			block_start_buffer_offset--;
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * Load groups which haven't been used yet until there are at least
+ * nr_blocks free blocks in the loaded ones, or there is nothing left
+ * to load. Returns 0 if the blocks are there.
+ */
+int simplefs_load_groups(struct super_block *sb, s64 nr_blocks)
+{
+	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(sb);
+	uint32_t i;
+
+	for (i = 0; i < msblk->nr_groups; i++) {
+		if (percpu_counter_sum_positive(&msblk->free_blocks_counter)
+				>= nr_blocks)
+			return 0;
+		if (!atomic_read(&msblk->unloaded_groups))
+			break;
+		simplefs_load_group(sb, i);
+	}
+	return percpu_counter_sum_positive(&msblk->free_blocks_counter)
+			>= nr_blocks ? 0 : -ENOSPC;
+}
+
+/*
+ * Try to get nr_blocks contiguous blocks out of group nr, at or
+ * after goal if it's not -1, else after the last allocation.
+ * Returns the bit within the group or -1. An indexed group finds the
+ * run in its free extent index and only touches the bitmap to mark it.
+ */
+static int32_t simplefs_group_alloc(struct super_block *sb, uint32_t nr,
+					int32_t goal, int nr_blocks)
+{
+	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(sb);
+	struct simple_fs_group_i *group = &msblk->groups[nr];
+	struct simplefs_fext *spare = NULL;
+	struct buffer_head *bh;
+	int32_t bit, found;
+
+	/* Racy peek, the real check is under the lock */
+	if (group->free_blocks < nr_blocks)
+		return -1;
+	bh = simplefs_group_bitmap(sb, nr);
+	if (!bh)
+		return -1;
+	/* Can't allocate under the spinlock, get the node a split may need */
+	if (group->indexed)
+		spare = simplefs_fext_alloc_node();
+	spin_lock(&group->lock);
+	if (goal < 0)
+		goal = group->last_alloc;
+	if (group->indexed) {
+		found = simplefs_fext_alloc(msblk, group, goal, nr_blocks,
+					&spare);
+		if (found < 0) {
+			spin_unlock(&group->lock);
+			kfree(spare);
+			brelse(bh);
+			return -1;
 		}
-		
-		bitmap_buffer = sb_buffer_bitmap->b_data;
-		while(blocks_alloced) {
-			if(free_bmap(bitmap_buffer,sb_buffer_bitmap->b_size,block_no++)){
-					blocks_alloced--;
-					if(buffer_uptodate(sb_buffer_bitmap))
-						mark_buffer_dirty(sb_buffer_bitmap);
-			}
-			/*
-			 * There was no freeing of block because this block_no didn't
-			 * belonged the starting buffer head. We need to move the
-			 * buffer head to new buffer or perhaps we might need to
-			 * get a new msblk->block_bitmap[j].
-			 */
-			else {
-				sb_buffer_bitmap = sb_buffer_bitmap->b_this_page;
-				if( sb_buffer_bitmap == msblk->block_bitmap[block_start_bitmap_index] )
-					sb_buffer_bitmap = msblk->block_bitmap[++block_start_bitmap_index];
-				block_no = 0; /*This is relative to the buffer head*/
-				bitmap_buffer = sb_buffer_bitmap->b_data;
-			}
+		bit = alloc_bmap_range(bh->b_data, group->bitmap_len,
+					found, nr_blocks);
+		if (WARN_ON_ONCE(bit != found))
+			simplefs_fext_drop(msblk, group);
+	} else
+		bit = alloc_bmap_range(bh->b_data, group->bitmap_len,
+					goal, nr_blocks);
+	if (bit >= 0) {
+		group->free_blocks -= nr_blocks;
+		group->last_alloc = bit + nr_blocks;
+	}
+	spin_unlock(&group->lock);
+	kfree(spare);
+	if (bit >= 0)
+		simplefs_meta_dirty(sb, &msblk->block_bitmap, bh);
+	brelse(bh);
+	return bit;
+}
+
+/*
+ * Delayed allocation reserves data blocks only, its tree and indirect
+ * blocks are not reserved up front. Keep this many blocks back for
+ * them while there are reservations.
+ */
+#define SIMPLEFS_DA_META_SLACK	32
+
+/*
+ * Whether nr_blocks can be allocated without taking the blocks delalloc
+ * reserved for dirty pages, or the slack their writeback may need.
+ */
+static int simplefs_can_claim(struct super_block *sb, int nr_blocks)
+{
+	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(sb);
+	s64 free = percpu_counter_read_positive(&msblk->free_blocks_counter);
+	s64 dirty = percpu_counter_read_positive(&msblk->dirty_blocks_counter);
+
+	if (free >= nr_blocks + dirty + SIMPLEFS_DA_META_SLACK +
+			2 * num_online_cpus())
+		return 1;
+	/* Close to the limit, get the exact counts */
+	dirty = percpu_counter_sum_positive(&msblk->dirty_blocks_counter);
+	return !simplefs_load_groups(sb, nr_blocks +
+				(dirty ? dirty + SIMPLEFS_DA_META_SLACK : 0));
+}
+
+/*
+ * Allocate nr_blocks contiguous blocks and return the first one, 0 on
+ * failure. goal is the block we would like to get, usually the one
+ * after the previous block of the file, 0 if there is none. Without a
+ * goal the search starts from the inode's home group so writers to
+ * different files mostly work on different groups and never contend
+ * on a filesystem wide lock.
+ *
+ * flags is SIMPLEFS_ALLOC_RESERVED when delalloc writeback allocates
+ * the blocks it reserved, those don't have to leave the reservations
+ * alone.
+ */
+uint64_t allocate_data_blocks(struct inode *vfs_inode, int nr_blocks,
+				uint64_t goal, int flags)
+{
+	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(vfs_inode->i_sb);
+	struct simple_fs_inode_i *minode = SIMPLEFS_INODE(vfs_inode);
+	uint32_t group, i;
+	int32_t bit, goal_bit = -1;
+
+	if (!nr_blocks)
+		return 0;
+	if (!(flags & SIMPLEFS_ALLOC_RESERVED)) {
+		if (!simplefs_can_claim(vfs_inode->i_sb, nr_blocks))
+			return 0;
+	} else if (percpu_counter_read_positive(&msblk->free_blocks_counter) <
+			nr_blocks && !atomic_read(&msblk->unloaded_groups))
+		return 0;
+	if (!goal)
+		goal = minode->alloc_goal;
+	if (goal && goal < msblk->sb.nr_blocks) {
+		minode->home_group = goal / SIMPLEFS_BLOCKS_PER_GROUP(msblk);
+		goal_bit = goal % SIMPLEFS_BLOCKS_PER_GROUP(msblk);
+	} else if (minode->home_group >= msblk->nr_groups)
+		minode->home_group = vfs_inode->i_ino % msblk->nr_groups;
+
+	for (i = 0, group = minode->home_group; i < msblk->nr_groups; i++) {
+		if (simplefs_load_group(vfs_inode->i_sb, group))
+			goto next;
+		/* The goal only means something in its own group */
+		bit = simplefs_group_alloc(vfs_inode->i_sb, group,
+					i ? -1 : goal_bit, nr_blocks);
+		if (bit >= 0) {
+			/* Keep coming back here while the group has room */
+			minode->home_group = group;
+			percpu_counter_sub(&msblk->free_blocks_counter, nr_blocks);
+			return (uint64_t)group * SIMPLEFS_BLOCKS_PER_GROUP(msblk) + bit;
 		}
+next:
+		if (++group == msblk->nr_groups)
+			group = 0;
 	}
-	simplefs_sync_metadata(sb);
-	mutex_unlock(msblk->sb_mutex);
 	return 0;
 }
 
+/*
+ * Give back nr_blocks blocks starting at block, they must all belong
+ * to the same group.
+ */
+void simplefs_free_data_blocks(struct super_block *sb, uint64_t block,
+				int nr_blocks)
+{
+	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(sb);
+	struct simple_fs_group_i *group;
+	struct simplefs_fext *spare = NULL;
+	struct buffer_head *bh;
+	uint32_t nr;
+	int32_t bit, run = -1;
+	int freed = 0, rebuild = 0;
+
+	if (block >= msblk->sb.nr_blocks)
+		return;
+	nr = block / SIMPLEFS_BLOCKS_PER_GROUP(msblk);
+	if (simplefs_load_group(sb, nr))
+		return;
+	bh = simplefs_group_bitmap(sb, nr);
+	if (!bh)
+		return;
+	group = &msblk->groups[nr];
+	bit = block % SIMPLEFS_BLOCKS_PER_GROUP(msblk);
+	/* Can't allocate under the spinlock, get the node freeing may need */
+	if (group->indexed)
+		spare = simplefs_fext_alloc_node();
+
+	spin_lock(&group->lock);
+	for (; nr_blocks >= 0; nr_blocks--, bit++) {
+		/* Only bits that really were in use go back to the index */
+		if (nr_blocks &&
+		    free_bmap(bh->b_data, group->bitmap_len, bit)) {
+			if (run < 0)
+				run = bit;
+			freed++;
+			continue;
+		}
+		if (run >= 0 && group->indexed)
+			simplefs_fext_free(msblk, group, run, bit - run, &spare);
+		run = -1;
+	}
+	group->free_blocks += freed;
+	if (freed && !group->indexed &&
+	    ++group->unindexed_frees == SIMPLEFS_FEXT_REBUILD_FREES) {
+		group->unindexed_frees = 0;
+		rebuild = 1;
+	}
+	spin_unlock(&group->lock);
+	kfree(spare);
+	if (freed) {
+		simplefs_meta_dirty(sb, &msblk->block_bitmap, bh);
+		percpu_counter_add(&msblk->free_blocks_counter, freed);
+	}
+	if (rebuild)
+		simplefs_fext_rebuild(msblk, group, bh->b_data);
+	brelse(bh);
+}
+
 
 /*
  * This one is the heart and soul. Most of the stuff is taken care of
@@ -219,141 +631,870 @@ out_failed:
  * pretty simple however in any case we need to use same stuff for 
  * read/write so be careful.
  *
- * Not sure about the return value, Perhaps the number of mapped blocks 
- * however mpage_readpages then sends it to "confused". Arrhh.....
+ * The return value is 0 or an error. How much got mapped is told back
+ * through bh_result->b_size, mpage_readpages and mpage_writepages ask
+ * for a whole range and build one bio out of it as long as we say the
+ * blocks are contiguous. Mapping one block at a time sends them to
+ * "confused" and tiny bios.
  */
 
-static int simplefs_get_block(struct inode *vfs_inode, sector_t iblock,
-				struct buffer_head *bh_result, int create)
+/*
+ * Files which don't use extents map file block 0 through
+ * data_block_number and the blocks after it through tables of
+ * block_size / 8 block numbers: the next ones through the indirect
+ * block, then through the double indirect block and its tables, then
+ * through the triple indirect one. The tables are read through the
+ * buffer cache, the top one of each level is kept in the inode so
+ * mapping a block costs one cached lookup per table on its way.
+ */
+static inline uint32_t simplefs_map_slots(struct inode *vfs_inode)
+{
+	return vfs_inode->i_sb->s_blocksize / sizeof(uint64_t);
+}
+
+/*
+ * Slots to follow from the top table of the level iblock is in down
+ * to the table holding it. Returns the number of tables, 0 for block
+ * 0 which is in the inode, or -EFBIG.
+ */
+static int simplefs_block_path(struct inode *vfs_inode, sector_t iblock,
+				int offsets[SIMPLEFS_MAP_DEPTH])
+{
+	int shift = vfs_inode->i_blkbits - 3;
+	uint64_t slots = simplefs_map_slots(vfs_inode), span = 1;
+	uint64_t n = iblock;
+	int depth, i;
+
+	if (!n)
+		return 0;
+	n--;
+	for (depth = 1; depth <= SIMPLEFS_MAP_DEPTH; depth++) {
+		span *= slots;
+		if (n < span)
+			break;
+		n -= span;
+	}
+	if (depth > SIMPLEFS_MAP_DEPTH)
+		return -EFBIG;
+	for (i = depth - 1; i >= 0; i--) {
+		offsets[i] = n & (slots - 1);
+		n >>= shift;
+	}
+	return depth;
+}
+
+/* The top table of the level with depth tables */
+static uint64_t simplefs_map_root(struct simple_fs_inode_i *minode, int depth)
+{
+	struct simplefs_block_map *map = (void *)minode->block_area;
+
+	if (depth == 1)
+		return minode->indirect_block_number;
+	if (depth == 2)
+		return le64_to_cpu(map->dind_block_number);
+	return le64_to_cpu(map->tind_block_number);
+}
+
+static void simplefs_set_map_root(struct simple_fs_inode_i *minode, int depth,
+				uint64_t block)
+{
+	struct simplefs_block_map *map = (void *)minode->block_area;
+
+	if (depth == 1)
+		minode->indirect_block_number = block;
+	else if (depth == 2)
+		map->dind_block_number = cpu_to_le64(block);
+	else
+		map->tind_block_number = cpu_to_le64(block);
+}
+
+static inline uint64_t simplefs_block_slot(struct simple_fs_inode_i *minode,
+					uint64_t *table, uint32_t slot)
+{
+	if (!table)
+		return minode->data_block_number;
+	return le64_to_cpu(table[slot]);
+}
+
+static inline void simplefs_set_block_slot(struct simple_fs_inode_i *minode,
+					uint64_t *table, uint32_t slot,
+					uint64_t block)
+{
+	if (!table)
+		minode->data_block_number = block;
+	else
+		table[slot] = cpu_to_le64(block);
+}
+
+/*
+ * Where to put a new block at slot of its table: right behind the
+ * closest mapped block before it, or behind the table if nothing
+ * before it is mapped. 0 leaves it to the allocator.
+ */
+static uint64_t simplefs_block_goal(struct buffer_head *table_bh, uint32_t slot)
+{
+	uint64_t *table;
+	uint32_t i;
+
+	if (!table_bh)
+		return 0;
+	table = (uint64_t *)table_bh->b_data;
+	for (i = slot; i-- > 0; )
+		if (table[i])
+			return le64_to_cpu(table[i]) + (slot - i);
+	return table_bh->b_blocknr + 1;
+}
+
+/* A new zeroed table as close to goal as possible */
+static int simplefs_new_table(struct inode *vfs_inode, uint64_t goal,
+				struct buffer_head **bhp)
+{
+	struct buffer_head *bh;
+	uint64_t block;
+
+	block = allocate_data_blocks(vfs_inode, 1, goal, 0);
+	if (!block) {
+		SFSDBG(KERN_INFO "Error allocating indirect block %s %d\n"
+				,__FUNCTION__,__LINE__);
+		return -ENOSPC;
+	}
+	bh = sb_getblk(vfs_inode->i_sb, block);
+	if (!bh) {
+		simplefs_free_data_blocks(vfs_inode->i_sb, block, 1);
+		return -EIO;
+	}
+	lock_buffer(bh);
+	memset(bh->b_data, 0, bh->b_size);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty_inode(bh, vfs_inode);
+	*bhp = bh;
+	return 0;
+}
+
+/*
+ * Tables allocated by one simplefs_get_table() call. Only the first
+ * one is linked from a table which was there before, or from the
+ * inode, the others hang below it.
+ */
+struct simplefs_new_tables {
+	int nr;
+	uint64_t blocks[SIMPLEFS_MAP_DEPTH];
+	uint64_t parent;	/*Table pointing to blocks[0], 0 for the inode*/
+	int slot;		/*Of blocks[0] in parent*/
+};
+
+static void simplefs_note_table(struct simplefs_new_tables *nt,
+				uint64_t block, struct buffer_head *parent,
+				int slot)
+{
+	if (!nt->nr++) {
+		nt->parent = parent ? parent->b_blocknr : 0;
+		nt->slot = slot;
+	}
+	nt->blocks[nt->nr - 1] = block;
+}
+
+/*
+ * Undo the tables of nt when there is no block to put under them.
+ * Called with map_sem held.
+ */
+static void simplefs_put_new_tables(struct inode *vfs_inode, int depth,
+				struct simplefs_new_tables *nt)
+{
+	struct super_block *sb = vfs_inode->i_sb;
+	struct buffer_head *bh;
+	int i;
+
+	if (!nt->nr)
+		return;
+	if (nt->parent) {
+		bh = sb_bread(sb, nt->parent);
+		if (!bh)
+			return; /*Can't unlink them, leave them in place*/
+		((uint64_t *)bh->b_data)[nt->slot] = 0;
+		mark_buffer_dirty_inode(bh, vfs_inode);
+		brelse(bh);
+	} else {
+		simplefs_set_map_root(SIMPLEFS_INODE(vfs_inode), depth, 0);
+		mark_inode_dirty(vfs_inode);
+	}
+	for (i = 0; i < nt->nr; i++) {
+		/* The zeroed table must not be written over a new owner */
+		bh = sb_find_get_block(sb, nt->blocks[i]);
+		if (bh)
+			bforget(bh);
+		simplefs_free_data_blocks(sb, nt->blocks[i], 1);
+	}
+	nt->nr = 0;
+}
+
+/*
+ * Get the table holding the block at the end of path in *bhp, reading
+ * down from the top table of its level and allocating the missing
+ * tables on the way if create is set. *bhp is left NULL if one isn't
+ * there. The tables allocated are recorded in nt, the caller gives
+ * them back with simplefs_put_new_tables() if it doesn't use them.
+ * Nothing is pinned for the life of the inode, the tables stay in the
+ * buffer cache. Called with map_sem held.
+ */
+static int simplefs_get_table(struct inode *vfs_inode, int depth,
+				int offsets[SIMPLEFS_MAP_DEPTH], int create,
+				struct buffer_head **bhp,
+				struct simplefs_new_tables *nt)
 {
-	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(vfs_inode->i_sb);
 	struct simple_fs_inode_i *minode = SIMPLEFS_INODE(vfs_inode);
-	uint64_t mapped_block = -1;
-	
-	if(iblock > msblk->sb.block_size/sizeof(uint64_t))
-		goto fail_get_block;
-	
-	if(create) {
-		/* Do we already have allocated the indirect block.
-		 * If yes then all we need to do is check the block location
-		 * for being 0 within that.
-		 */
-		if(iblock) {
-allocate_indirect_block:
-			if(minode->inode.indirect_block_number) {
-				if(!minode->indirect_block) {
-					minode->indirect_block =
-						sb_bread(vfs_inode->i_sb,
-							minode->inode.indirect_block_number);
-					if(!minode->indirect_block)
-						goto fail_get_block;
-				}
-				uint64_t *block_offset = 
-					((uint64_t*)(minode->indirect_block->b_data) + (iblock-1));
-				mapped_block = le64_to_cpu(*block_offset);
-				if(!mapped_block) {
-					mapped_block = allocate_data_blocks(vfs_inode,1);
-					if (!mapped_block) {
-						SFSDBG(KERN_INFO "Error allocating indirect data block %s %d\n"
-							,__FUNCTION__,__LINE__);
-						goto fail_get_block;
-					}
-				}
-				*block_offset = cpu_to_le64(mapped_block);
-				mark_buffer_dirty(minode->indirect_block);
-				mapped_block = block_offset;
-			}
-			else { /*Allocate that indirect block and the block within*/
-				minode->inode.indirect_block_number = allocate_data_blocks(vfs_inode,1);
-				if(!minode->inode.indirect_block_number) {
-					SFSDBG(KERN_INFO "Error allocating indirect block %s %d\n"
-							,__FUNCTION__,__LINE__);
-					goto fail_get_block;
-				}
-				else
-					goto allocate_indirect_block;
+	struct buffer_head *bh, *child;
+	uint64_t block, goal;
+	int level, ret;
+
+	*bhp = NULL;
+	nt->nr = 0;
+	block = simplefs_map_root(minode, depth);
+	if (block) {
+		bh = sb_bread(vfs_inode->i_sb, block);
+		if (!bh)
+			return -EIO;
+	} else {
+		if (!create)
+			return 0;
+		/* Behind the blocks of the level before, where the file ends */
+		goal = depth == 1 ? minode->data_block_number :
+			simplefs_map_root(minode, depth - 1);
+		ret = simplefs_new_table(vfs_inode, goal ? goal + 1 : 0, &bh);
+		if (ret)
+			return ret;
+		simplefs_set_map_root(minode, depth, bh->b_blocknr);
+		mark_inode_dirty(vfs_inode);
+		simplefs_note_table(nt, bh->b_blocknr, NULL, 0);
+	}
+
+	for (level = 0; level < depth - 1; level++) {
+		uint64_t *table = (uint64_t *)bh->b_data;
+
+		block = le64_to_cpu(table[offsets[level]]);
+		if (block) {
+			child = sb_bread(vfs_inode->i_sb, block);
+			ret = child ? 0 : -EIO;
+		} else if (create) {
+			ret = simplefs_new_table(vfs_inode,
+				simplefs_block_goal(bh, offsets[level]), &child);
+			if (!ret) {
+				table[offsets[level]] = cpu_to_le64(child->b_blocknr);
+				mark_buffer_dirty_inode(bh, vfs_inode);
+				simplefs_note_table(nt, child->b_blocknr, bh,
+						offsets[level]);
 			}
+		} else {
+			child = NULL;
+			ret = 0;
 		}
-		else { /*This is the first block for the file*/
-			if( minode->inode.data_block_number ){
-				mapped_block = le64_to_cpu(minode->inode.data_block_number);
-			}
-			else
-			{
-				minode->inode.data_block_number = allocate_data_blocks(vfs_inode,1);
-				if(!minode->inode.data_block_number) {
-					SFSDBG(KERN_INFO "Error allocating direct block %s %d\n"
-							,__FUNCTION__,__LINE__);
-					goto fail_get_block;
-				}
-				mapped_block = minode->inode.data_block_number;
-				minode->inode.data_block_number = cpu_to_le64(
-						minode->inode.data_block_number);
-			}
+		brelse(bh);
+		if (ret) {
+			simplefs_put_new_tables(vfs_inode, depth, nt);
+			return ret;
 		}
+		if (!child)
+			return 0;
+		bh = child;
+	}
+	*bhp = bh;
+	return 0;
+}
+
+static inline int simplefs_is_inline(struct simple_fs_inode_i *minode)
+{
+	return minode->flags & SIMPLEFS_INODE_INLINE;
+}
+
+int simplefs_get_block(struct inode *vfs_inode, sector_t iblock,
+			struct buffer_head *bh_result, int create)
+{
+	struct simple_fs_inode_i *minode = SIMPLEFS_INODE(vfs_inode);
+	uint32_t max_blocks = bh_result->b_size >> vfs_inode->i_blkbits;
+	uint32_t nr_mapped = 0, nr_slots = 1, slot = 0, i;
+	int offsets[SIMPLEFS_MAP_DEPTH], depth;
+	uint64_t mapped_block = 0;
+	struct buffer_head *table_bh = NULL;
+	struct simplefs_new_tables nt = { .nr = 0 };
+	uint64_t *table = NULL;
+	int new = 0, ret = 0;
+
+	if(minode->flags & SIMPLEFS_INODE_EXTENTS)
+		return simplefs_ext_get_block(vfs_inode,iblock,bh_result,create);
+	/*
+	 * An inline file has no blocks, write_begin turns it into a
+	 * block mapped one before anything can be allocated for it.
+	 */
+	if(simplefs_is_inline(minode))
+		return create ? -EIO : 0;
+
+	depth = simplefs_block_path(vfs_inode, iblock, offsets);
+	if(depth < 0)
+		return depth;
+	/* A run of blocks is only mapped within one table */
+	if(depth) {
+		slot = offsets[depth - 1];
+		nr_slots = simplefs_map_slots(vfs_inode);
+	}
+	if(!max_blocks)
+		max_blocks = 1;
+	max_blocks = min_t(uint32_t, max_blocks, nr_slots - slot);
+
+	if(create)
+		down_write(&minode->map_sem);
+	else
+		down_read(&minode->map_sem);
+
+	if(depth) {
+		ret = simplefs_get_table(vfs_inode, depth, offsets, create,
+					&table_bh, &nt);
+		if(ret || !table_bh)
+			goto out; /*Or a hole under a table that isn't there*/
+		table = (uint64_t *)table_bh->b_data;
 	}
-	else {
-	
+
+	mapped_block = simplefs_block_slot(minode, table, slot);
+	if(mapped_block) {
 		/*
-		 * Find the mapping but don't create it.
+		 * Count how many of the following blocks sit right
+		 * behind this one on disk.
 		 */
-		if(iblock) {
-			if(minode->inode.indirect_block_number) {
-				if(!minode->indirect_block) {
-					minode->indirect_block =
-						sb_bread(vfs_inode->i_sb,
-							minode->inode.indirect_block_number);
-					if(!minode->indirect_block)
-						goto fail_get_block;
-				}
-				uint64_t *block_offset = 
-					((uint64_t*)(minode->indirect_block->b_data) + (iblock-1));
-				mapped_block = le64_to_cpu(*block_offset);
-				if(!mapped_block)
-					goto fail_get_block;
-			}
-			else
-				goto fail_get_block;
-		}
-		else {
-			if(!minode->inode.data_block_number)
-				goto fail_get_block;
-			mapped_block = le64_to_cpu(minode->inode.data_block_number);
+		nr_mapped = 1;
+		while(nr_mapped < max_blocks &&
+			simplefs_block_slot(minode, table, slot + nr_mapped)
+					== mapped_block + nr_mapped)
+			nr_mapped++;
+	}
+	else if(create) {
+		/*
+		 * Fill the whole hole we have been asked for with
+		 * one contiguous allocation if we can get one.
+		 */
+		uint32_t hole = 1;
+		uint64_t goal = simplefs_block_goal(table_bh, slot);
+
+		while(hole < max_blocks &&
+			!simplefs_block_slot(minode, table, slot + hole))
+			hole++;
+		while(hole && !(mapped_block = allocate_data_blocks(vfs_inode,
+					hole, goal, create & SIMPLEFS_ALLOC_RESERVED)))
+			hole >>= 1;
+		if(!mapped_block) {
+			SFSDBG(KERN_INFO "Error allocating data block %s %d\n"
+					,__FUNCTION__,__LINE__);
+			ret = -ENOSPC;
+			/* Tables made for this block would stay empty */
+			brelse(table_bh);
+			table_bh = NULL;
+			simplefs_put_new_tables(vfs_inode, depth, &nt);
+			goto out;
 		}
+		for(i = 0; i < hole; i++)
+			simplefs_set_block_slot(minode, table, slot + i,
+					mapped_block + i);
+		if(table)
+			mark_buffer_dirty_inode(table_bh, vfs_inode);
+		else
+			mark_inode_dirty(vfs_inode);
+		nr_mapped = hole;
+		new = 1;
 	}
-	set_buffer_new(bh_result);
+out:
+	if(create)
+		up_write(&minode->map_sem);
+	else
+		up_read(&minode->map_sem);
+	brelse(table_bh);
+	if(ret || !nr_mapped)
+		return ret; /*A hole, leave bh_result unmapped*/
+
 	map_bh(bh_result,vfs_inode->i_sb,mapped_block);
+	bh_result->b_size = (size_t)nr_mapped << vfs_inode->i_blkbits;
+	if(new)
+		set_buffer_new(bh_result);
+	return 0;
+}
+
+/*
+ * Delayed allocation.
+ *
+ * With delalloc write_begin doesn't allocate anything. A hole that gets
+ * written is only reserved against the free block count and its buffer
+ * is marked delayed and mapped to SIMPLEFS_DELALLOC_BLOCK. The real
+ * blocks are allocated at writeback, when the whole dirty range is
+ * known and can be given contiguous blocks in one go.
+ *
+ * This relies on one buffer per page, so it is only used when the
+ * block size is the page size.
+ */
+#define SIMPLEFS_DELALLOC_BLOCK	(~(sector_t)0)
+#define SIMPLEFS_DA_MAX_PAGES	256 /*Longest run allocated at once*/
+
+struct simplefs_da_run {
+	struct inode *inode;
+	pgoff_t first;		/*File block of the first page*/
+	int nr_pages;
+	struct page *pages[SIMPLEFS_DA_MAX_PAGES];
+};
+
+static inline int simplefs_use_delalloc(struct inode *vfs_inode)
+{
+	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(vfs_inode->i_sb);
+
+	return (msblk->mount_opts & SIMPLEFS_MOUNT_DELALLOC) &&
+		vfs_inode->i_blkbits == PAGE_CACHE_SHIFT;
+}
+
+static int simplefs_da_reserve(struct inode *vfs_inode)
+{
+	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(vfs_inode->i_sb);
+	s64 free = percpu_counter_read_positive(&msblk->free_blocks_counter);
+	s64 dirty = percpu_counter_read_positive(&msblk->dirty_blocks_counter);
+
+	if (free < dirty + 1 + SIMPLEFS_DA_META_SLACK + 2 * num_online_cpus()) {
+		/* Close to the limit, get the exact counts */
+		dirty = percpu_counter_sum_positive(&msblk->dirty_blocks_counter);
+		if (simplefs_load_groups(vfs_inode->i_sb,
+					dirty + 1 + SIMPLEFS_DA_META_SLACK))
+			return -ENOSPC;
+	}
+	percpu_counter_inc(&msblk->dirty_blocks_counter);
+	atomic_inc(&SIMPLEFS_INODE(vfs_inode)->da_reserved);
+	return 0;
+}
+
+static void simplefs_da_release(struct inode *vfs_inode, int nr_blocks)
+{
+	struct simple_fs_sb_i *msblk = SIMPLEFS_SB(vfs_inode->i_sb);
+
+	if (!nr_blocks)
+		return;
+	percpu_counter_sub(&msblk->dirty_blocks_counter, nr_blocks);
+	atomic_sub(nr_blocks, &SIMPLEFS_INODE(vfs_inode)->da_reserved);
+}
+
+/*
+ * get_block for write_begin in delalloc mode. Blocks which are already
+ * mapped are returned as they are, holes are only reserved.
+ */
+static int simplefs_da_get_block(struct inode *vfs_inode, sector_t iblock,
+				struct buffer_head *bh_result, int create)
+{
+	int ret;
+
+	ret = simplefs_get_block(vfs_inode, iblock, bh_result, 0);
+	if (ret || buffer_mapped(bh_result))
+		return ret;
+	ret = simplefs_da_reserve(vfs_inode);
+	if (ret)
+		return ret;
+	map_bh(bh_result, vfs_inode->i_sb, SIMPLEFS_DELALLOC_BLOCK);
+	set_buffer_new(bh_result);
+	set_buffer_delay(bh_result);
+	return 0;
+}
+
+/*
+ * Allocate the blocks for nr_pages locked pages with delayed buffers,
+ * consecutive in the file starting at first, and point the buffers at
+ * the new blocks.
+ */
+static int simplefs_da_map_pages(struct inode *vfs_inode, pgoff_t first,
+				struct page **pages, int nr_pages)
+{
+	struct buffer_head map, *bh;
+	int done = 0, n, ret = 0;
+
+	while (done < nr_pages) {
+		map.b_state = 0;
+		map.b_size = (size_t)(nr_pages - done) << vfs_inode->i_blkbits;
+		/* The blocks were reserved by simplefs_da_reserve() */
+		ret = simplefs_get_block(vfs_inode, first + done, &map,
+					1 | SIMPLEFS_ALLOC_RESERVED);
+		if (!ret && !buffer_mapped(&map))
+			ret = -EIO;
+		if (ret)
+			break;
+		for (n = 0; n < (map.b_size >> vfs_inode->i_blkbits); n++) {
+			bh = page_buffers(pages[done + n]);
+			bh->b_blocknr = map.b_blocknr + n;
+			clear_buffer_delay(bh);
+			unmap_underlying_metadata(bh->b_bdev, bh->b_blocknr);
+		}
+		done += n;
+	}
+	simplefs_da_release(vfs_inode, done);
+	return ret;
+}
+
+/*
+ * Map the pages of the run and write them out. They were locked and
+ * cleaned for I/O by write_cache_pages() and stayed locked since, so
+ * none of them can be redirtied with its buffer still delayed. Pages
+ * left delayed because the allocation failed are redirtied.
+ */
+static int simplefs_da_flush_run(struct simplefs_da_run *run,
+				struct writeback_control *wbc)
+{
+	int ret, i;
+
+	if (!run->nr_pages)
+		return 0;
+	ret = simplefs_da_map_pages(run->inode, run->first,
+				run->pages, run->nr_pages);
+	for (i = 0; i < run->nr_pages; i++) {
+		struct page *page = run->pages[i];
+
+		if (buffer_delay(page_buffers(page))) {
+			redirty_page_for_writepage(wbc, page);
+			unlock_page(page);
+		} else
+			mpage_writepage(page, simplefs_get_block, wbc);
+	}
+	run->nr_pages = 0;
+	return ret;
+}
+
+/*
+ * write_cache_pages() callback. Delayed pages are kept locked in the
+ * run until a page which doesn't follow them, the run is then given
+ * one allocation. Other pages are written as they come.
+ */
+static int simplefs_da_write_page(struct page *page,
+				struct writeback_control *wbc, void *data)
+{
+	struct simplefs_da_run *run = data;
+	int ret;
+
+	if (!page_has_buffers(page) || !buffer_delay(page_buffers(page))) {
+		ret = simplefs_da_flush_run(run, wbc);
+		if (ret) {
+			redirty_page_for_writepage(wbc, page);
+			unlock_page(page);
+			return ret;
+		}
+		return mpage_writepage(page, simplefs_get_block, wbc);
+	}
+	if (run->nr_pages &&
+		(page->index != run->first + run->nr_pages ||
+		 run->nr_pages == SIMPLEFS_DA_MAX_PAGES)) {
+		ret = simplefs_da_flush_run(run, wbc);
+		if (ret) {
+			redirty_page_for_writepage(wbc, page);
+			unlock_page(page);
+			return ret;
+		}
+	}
+	if (!run->nr_pages)
+		run->first = page->index;
+	run->pages[run->nr_pages++] = page;
+	return 0;
+}
+
+/*
+ * writepages for an inode with delayed blocks. The pages are mapped in
+ * the writeback pass itself, with each page locked from the time it is
+ * cleaned until its I/O is started.
+ */
+static int simplefs_da_write_pages(struct address_space *mapping,
+				struct writeback_control *wbc)
+{
+	struct simplefs_da_run *run;
+	struct blk_plug plug;
+	int ret, err;
+
+	run = kmalloc(sizeof(*run), GFP_NOFS);
+	if (!run)
+		return -ENOMEM;
+	run->inode = mapping->host;
+	run->nr_pages = 0;
+	/* Each page is its own bio, let the block layer merge them */
+	blk_start_plug(&plug);
+	ret = write_cache_pages(mapping, wbc, simplefs_da_write_page, run);
+	err = simplefs_da_flush_run(run, wbc);
+	blk_finish_plug(&plug);
+	kfree(run);
+	return ret ? ret : err;
+}
+
+/*
+ * Delayed pages which are truncated away give their reservation back.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0)
+static void simplefs_invalidate_page(struct page *page, unsigned int offset,
+					unsigned int length)
+#else
+static void simplefs_invalidate_page(struct page *page, unsigned long offset)
+#endif
+{
+	struct buffer_head *head, *bh;
+	unsigned int curr = 0, next;
+	int released = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0)
+	unsigned int stop = offset + length;
+#else
+	unsigned int stop = PAGE_CACHE_SIZE;
+#endif
+
+	if (page_has_buffers(page)) {
+		head = bh = page_buffers(page);
+		do {
+			next = curr + bh->b_size;
+			if (next > stop)
+				break;
+			if (curr >= offset && buffer_delay(bh))
+				released++;
+			curr = next;
+		} while ((bh = bh->b_this_page) != head);
+		simplefs_da_release(page->mapping->host, released);
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0)
+	block_invalidatepage(page, offset, length);
+#else
+	block_invalidatepage(page, offset);
+#endif
+}
+
+/*
+ * Inline files.
+ *
+ * On a filesystem with the inline data feature a new file keeps its
+ * contents in its inode table slot, up to SIMPLEFS_INODE_INLINE_MAX
+ * bytes. Page 0 is filled from there when it is read and copied back
+ * by write_end, so a small file costs no data block and no I/O besides
+ * its inode table block. A write going past the inline area moves the
+ * contents to page 0, left dirty, and maps the file with blocks from
+ * then on. The block is allocated when that page is written back.
+ *
+ * The inline data and the flag only change with page 0 locked.
+ */
+
+/*
+ * Copy [pos, pos + len) of an inline file between page 0 and the inode
+ * table block.
+ */
+static int simplefs_inline_copy(struct inode *vfs_inode, struct page *page,
+				unsigned pos, unsigned len, int to_inode)
+{
+	struct simplefs_inode *disk_inode;
+	struct buffer_head *bh;
+	char *kaddr;
+
+	bh = simplefs_inode_bread(vfs_inode->i_sb, vfs_inode->i_ino, &disk_inode);
+	if (!bh)
+		return -EIO;
+	if (to_inode)
+		lock_buffer(bh);
+	kaddr = kmap_atomic(page);
+	if (to_inode)
+		memcpy(disk_inode->inline_data + pos, kaddr + pos, len);
+	else
+		memcpy(kaddr + pos, disk_inode->inline_data + pos, len);
+	kunmap_atomic(kaddr);
+	if (to_inode) {
+		unlock_buffer(bh);
+		simplefs_meta_dirty(vfs_inode->i_sb,
+				&SIMPLEFS_SB(vfs_inode->i_sb)->inode_table, bh);
+	}
+	brelse(bh);
 	return 0;
-fail_get_block:
-	return -EOF;
+}
+
+static int simplefs_inline_fill_page(struct inode *vfs_inode,
+					struct page *page)
+{
+	unsigned size = 0;
+	int ret;
+
+	if (!page->index)
+		size = min_t(loff_t, i_size_read(vfs_inode),
+				SIMPLEFS_INODE_INLINE_MAX);
+	if (size) {
+		ret = simplefs_inline_copy(vfs_inode, page, 0, size, 0);
+		if (ret)
+			return ret;
+	}
+	zero_user_segment(page, size, PAGE_CACHE_SIZE);
+	SetPageUptodate(page);
+	return 0;
+}
+
+/*
+ * Called with page 0 locked and i_mutex held.
+ */
+static int simplefs_inline_convert(struct inode *vfs_inode,
+					struct page *page)
+{
+	struct simple_fs_inode_i *minode = SIMPLEFS_INODE(vfs_inode);
+	struct simplefs_inode *disk_inode;
+	struct buffer_head *bh;
+	int ret;
+
+	if (!PageUptodate(page)) {
+		ret = simplefs_inline_fill_page(vfs_inode, page);
+		if (ret)
+			return ret;
+	}
+	bh = simplefs_inode_bread(vfs_inode->i_sb, vfs_inode->i_ino, &disk_inode);
+	if (!bh)
+		return -EIO;
+	down_write(&minode->map_sem);
+	lock_buffer(bh);
+	memset(disk_inode->inline_data, 0, SIMPLEFS_INODE_INLINE_MAX);
+	minode->flags &= ~SIMPLEFS_INODE_INLINE;
+	if (SIMPLEFS_SB(vfs_inode->i_sb)->sb.features & SIMPLEFS_FEATURE_EXTENTS)
+		simplefs_ext_init(minode);
+	simplefs_inode_to_disk(vfs_inode, disk_inode);
+	unlock_buffer(bh);
+	up_write(&minode->map_sem);
+	simplefs_meta_dirty(vfs_inode->i_sb,
+			&SIMPLEFS_SB(vfs_inode->i_sb)->inode_table, bh);
+	brelse(bh);
+	if (i_size_read(vfs_inode))
+		set_page_dirty(page);
+	return 0;
+}
+
+static int simplefs_inline_write_begin(struct address_space *mapping,
+				loff_t pos, unsigned len, unsigned flags,
+				struct page **pagep)
+{
+	struct inode *vfs_inode = mapping->host;
+	struct page *page;
+	int ret = 0;
+
+	page = grab_cache_page_write_begin(mapping, 0, flags);
+	if (!page)
+		return -ENOMEM;
+	if (simplefs_is_inline(SIMPLEFS_INODE(vfs_inode))) {
+		if (pos + len <= SIMPLEFS_INODE_INLINE_MAX) {
+			if (!PageUptodate(page))
+				ret = simplefs_inline_fill_page(vfs_inode, page);
+			if (!ret) {
+				*pagep = page;
+				return 0;
+			}
+		} else
+			ret = simplefs_inline_convert(vfs_inode, page);
+	}
+	unlock_page(page);
+	page_cache_release(page);
+	*pagep = NULL;
+	return ret;
+}
+
+/*
+ * Move an inline file to blocks for a caller which is going to map
+ * blocks itself, like fallocate. Called with i_mutex held, page 0 is
+ * locked the way write_begin locks it.
+ */
+int simplefs_inline_to_blocks(struct inode *vfs_inode)
+{
+	struct page *page;
+	int ret = 0;
+
+	page = grab_cache_page_write_begin(vfs_inode->i_mapping, 0, 0);
+	if (!page)
+		return -ENOMEM;
+	if (simplefs_is_inline(SIMPLEFS_INODE(vfs_inode)))
+		ret = simplefs_inline_convert(vfs_inode, page);
+	unlock_page(page);
+	page_cache_release(page);
+	return ret;
+}
+
+static int simplefs_inline_write_end(struct inode *vfs_inode, loff_t pos,
+				unsigned copied, struct page *page)
+{
+	int ret;
+
+	/* The page is uptodate, a short copy just writes less */
+	ret = simplefs_inline_copy(vfs_inode, page, pos, copied, 1);
+	if (!ret && pos + copied > i_size_read(vfs_inode)) {
+		i_size_write(vfs_inode, pos + copied);
+		mark_inode_dirty(vfs_inode);
+	}
+	unlock_page(page);
+	page_cache_release(page);
+	return ret ? ret : copied;
+}
+
+/*
+ * Only a page written through mmap gets here, the data goes back
+ * to the inode table block.
+ */
+static int simplefs_inline_write_page(struct page *page)
+{
+	struct inode *vfs_inode = page->mapping->host;
+	unsigned size;
+	int ret = 0;
+
+	if (!page->index) {
+		size = min_t(loff_t, i_size_read(vfs_inode),
+				SIMPLEFS_INODE_INLINE_MAX);
+		ret = simplefs_inline_copy(vfs_inode, page, 0, size, 1);
+	}
+	if (ret)
+		SetPageError(page);
+	unlock_page(page);
+	return ret;
 }
 
 static int simplefs_read_pages(struct file *filp,struct address_space *mapping
 					,struct list_head *pages,unsigned nr_pages)
 {
 	SFSDBG(KERN_INFO "Read pages started \n");
-	dump_stack();
+	/* Pages left out here are read through readpage */
+	if (simplefs_is_inline(SIMPLEFS_INODE(mapping->host)))
+		return 0;
 	return mpage_readpages(mapping,pages,nr_pages,simplefs_get_block);
 }
 static int simplefs_write_pages(struct address_space *mapping,
 				struct writeback_control *wbc)
 {
 	SFSDBG(KERN_INFO "Write pages started \n");
-	dump_stack();
+	if (simplefs_is_inline(SIMPLEFS_INODE(mapping->host)))
+		return generic_writepages(mapping, wbc);
+	/*
+	 * Not only when da_reserved is set, a page can get delayed
+	 * buffers while writeback is looking for dirty pages.
+	 */
+	if (simplefs_use_delalloc(mapping->host))
+		return simplefs_da_write_pages(mapping, wbc);
 	return mpage_writepages(mapping,wbc,simplefs_get_block);
 }
 
 static int simplefs_read_page(struct file *filp,struct page *page)
 {
 	SFSDBG(KERN_INFO "Read page started \n");
-	dump_stack();
+	if (simplefs_is_inline(SIMPLEFS_INODE(page->mapping->host))) {
+		int ret = simplefs_inline_fill_page(page->mapping->host, page);
+
+		if (ret)
+			SetPageError(page);
+		unlock_page(page);
+		return ret;
+	}
 	return mpage_readpage(page,simplefs_get_block);
 }
 
 static int simplefs_write_page(struct page *page,struct writeback_control *wbc)
 {
+	int ret;
+
 	SFSDBG(KERN_INFO "Write page started \n");
-	dump_stack();
+	if (simplefs_is_inline(SIMPLEFS_INODE(page->mapping->host)))
+		return simplefs_inline_write_page(page);
+	if (page_has_buffers(page) && buffer_delay(page_buffers(page))) {
+		ret = simplefs_da_map_pages(page->mapping->host, page->index,
+					&page, 1);
+		if (ret) {
+			redirty_page_for_writepage(wbc, page);
+			unlock_page(page);
+			return ret;
+		}
+	}
 	return mpage_writepage(page,simplefs_get_block,wbc);
 }
 
@@ -361,8 +1502,17 @@ int simplefs_write_begin(struct file *, struct address_space *mapping,
 			loff_t pos, unsigned len, unsigned flags,
 			struct page **pagep, void **fsdata)
 {
+	int ret;
+
 	SFSDBG(KERN_INFO "Write begin started \n");
-	dump_stack();
+	if (simplefs_is_inline(SIMPLEFS_INODE(mapping->host))) {
+		ret = simplefs_inline_write_begin(mapping, pos, len, flags, pagep);
+		if (ret || *pagep)
+			return ret;
+	}
+	if (simplefs_use_delalloc(mapping->host))
+		return block_write_begin(mapping,pos,
+				len,flags,pagep,simplefs_da_get_block);
 	return block_write_begin(mapping,pos,
 			len,flags,pagep,simplefs_get_block);
 }
@@ -372,24 +1522,30 @@ int simplefs_write_end(struct file *file, struct address_space *mapping,
                                 struct page *page, void *fsdata)
 {
 	SFSDBG(KERN_INFO "Write end started \n");
-	dump_stack();
+	if (simplefs_is_inline(SIMPLEFS_INODE(mapping->host)))
+		return simplefs_inline_write_end(mapping->host, pos,
+						copied, page);
 	return generic_write_end(file,mapping,pos,
 			len,copied,page,fsdata);
 }
 
 
 struct address_space_operations simplefs_aops ={
-	.readpage 	= simplefs_read_page;
-	.readpages 	= simplefs_read_pages;
-	.writepage  = simplefs_write_page;
-	.writepages = simplefs_write_pages;
-	.write_begin = simplefs_write_begin;
-	.write_end = simeplfs_write_end;
+	.readpage 	= simplefs_read_page,
+	.readpages 	= simplefs_read_pages,
+	.writepage  = simplefs_write_page,
+	.writepages = simplefs_write_pages,
+	.write_begin = simplefs_write_begin,
+	.write_end = simplefs_write_end,
+	.invalidatepage = simplefs_invalidate_page,
 };
 
 struct super_operations simplefs_sops= {
 	.alloc_inode = simplefs_alloc_inode,
 	.destroy_inode = simplefs_destroy_inode,
+	.evict_inode = simplefs_evict_inode,
 	.put_super = simplefs_put_super,
 	.write_inode = simplefs_write_inode,
+	.sync_fs = simplefs_sync_fs,
+	.show_stats = simplefs_show_stats,
 };
@@ -1,3 +1,4 @@
+#include <linux/version.h>
 #include <linux/fs.h>
 #include "simple.h"
 #include "simple_fs.h"
@@ -10,9 +11,122 @@ static inline struct simple_fs_inode_i *SIMPLEFS_INODE(struct inode *inode)
 {
 	return container_of(inode,struct simple_fs_inode_i,vfs_inode);
 }
+
+/* i_mutex is only reached through inode_lock() from 4.5, it is gone in 4.7 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,5,0)
+static inline void inode_lock(struct inode *inode)
+{
+	mutex_lock(&inode->i_mutex);
+}
+
+static inline void inode_unlock(struct inode *inode)
+{
+	mutex_unlock(&inode->i_mutex);
+}
+#endif
 extern struct super_operations simplefs_sops;
 /*
  * This one syncs all the dirty buffer heads
  * which are being used for meta-data.
  */
-extern void simplefs_sync_metadata(struct super_block *sb); 
+extern int simplefs_sync_metadata(struct super_block *sb, int wait);
+extern int simplefs_fsync(struct file *file, loff_t start, loff_t end,
+			int datasync);
+extern int simplefs_init_inodecache(void);
+extern void simplefs_destroy_inodecache(void);
+extern void simplefs_inode_to_disk(struct inode *vfs_inode,
+				struct simplefs_inode *disk);
+extern struct inode *simplefs_iget(struct super_block *sb, uint64_t inode_no);
+extern struct address_space_operations simplefs_aops;
+extern int simplefs_get_block(struct inode *vfs_inode, sector_t iblock,
+				struct buffer_head *bh_result, int create);
+extern int simplefs_inline_to_blocks(struct inode *vfs_inode);
+/*
+ * Directory entries, see dir.c
+ */
+extern int simplefs_dir_find(struct inode *dir, const char *name, int len,
+				uint64_t *ino);
+extern int simplefs_dir_add(struct inode *dir, const char *name, int len,
+				uint64_t ino, umode_t mode);
+extern int simplefs_dir_init(struct inode *dir);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0)
+extern int simplefs_iterate(struct file *filp, struct dir_context *ctx);
+#else
+extern int simplefs_readdir(struct file *filp, void *dirent, filldir_t filldir);
+#endif
+extern loff_t simplefs_dir_llseek(struct file *filp, loff_t offset, int whence);
+/*
+ * Meta-data blocks, see meta.c
+ */
+extern int simplefs_meta_init(struct super_block *sb);
+extern void simplefs_meta_destroy(struct super_block *sb);
+extern struct buffer_head *simplefs_meta_bread(struct super_block *sb,
+					struct simplefs_meta_area *area,
+					uint32_t index);
+extern void simplefs_meta_dirty(struct super_block *sb,
+				struct simplefs_meta_area *area,
+				struct buffer_head *bh);
+extern struct buffer_head *simplefs_inode_bread(struct super_block *sb,
+					uint64_t inode_no,
+					struct simplefs_inode **raw);
+extern int simplefs_inode_readahead(struct super_block *sb,
+					uint64_t inode_no);
+extern void simplefs_meta_write(struct super_block *sb,
+				struct simplefs_meta_area *area);
+extern int simplefs_meta_wait(struct super_block *sb,
+				struct simplefs_meta_area *area);
+extern int simplefs_show_stats(struct seq_file *m, struct dentry *root);
+/*
+ * Inode numbers, see ialloc.c
+ */
+extern int simplefs_ialloc_init(struct super_block *sb);
+extern void simplefs_ialloc_destroy(struct super_block *sb);
+extern uint64_t simplefs_new_inode_no(struct super_block *sb);
+extern void simplefs_free_inode_no(struct super_block *sb, uint64_t ino);
+/*
+ * Block groups, see struct simple_fs_group_i.
+ */
+extern int simplefs_init_groups(struct super_block *sb);
+extern void simplefs_destroy_groups(struct super_block *sb);
+extern int simplefs_load_groups(struct super_block *sb, s64 nr_blocks);
+extern void simplefs_free_data_blocks(struct super_block *sb, uint64_t block,
+					int nr_blocks);
+/*
+ * The blocks are ones delalloc reserved. Also passed in the create
+ * argument of simplefs_get_block() by delalloc writeback.
+ */
+#define SIMPLEFS_ALLOC_RESERVED	0x2
+extern uint64_t allocate_data_blocks(struct inode *vfs_inode, int nr_blocks,
+					uint64_t goal, int flags);
+/*
+ * Free extent index of a group, see free_extents.c. Everything but
+ * build and drop at group load/umount and rebuild is called with the
+ * group lock held.
+ */
+struct simplefs_fext;
+extern int simplefs_fext_build(struct simple_fs_sb_i *msblk,
+				struct simple_fs_group_i *group,
+				const char *bitmap);
+/* Frees into a group without an index between two rebuild attempts */
+#define SIMPLEFS_FEXT_REBUILD_FREES	64
+extern void simplefs_fext_rebuild(struct simple_fs_sb_i *msblk,
+				struct simple_fs_group_i *group,
+				const char *bitmap);
+extern void simplefs_fext_drop(struct simple_fs_sb_i *msblk,
+				struct simple_fs_group_i *group);
+extern int32_t simplefs_fext_alloc(struct simple_fs_sb_i *msblk,
+				struct simple_fs_group_i *group,
+				uint32_t goal, uint32_t n, struct simplefs_fext **spare);
+extern void simplefs_fext_free(struct simple_fs_sb_i *msblk,
+				struct simple_fs_group_i *group,
+				uint32_t bit, uint32_t n, struct simplefs_fext **spare);
+extern struct simplefs_fext *simplefs_fext_alloc_node(void);
+extern unsigned long simplefs_fext_memory(struct simple_fs_sb_i *msblk);
+/*
+ * Extent mapping, see extents.c
+ */
+extern void simplefs_ext_init(struct simple_fs_inode_i *minode);
+extern int simplefs_ext_get_block(struct inode *vfs_inode, sector_t iblock,
+				struct buffer_head *bh_result, int create);
+extern long simplefs_fallocate(struct file *file, int mode, loff_t offset,
+				loff_t len);
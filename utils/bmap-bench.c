@@ -0,0 +1,110 @@
+/*
+ * Userspace microbenchmark for the bitmap allocator in simplefs-lib.c.
+ *
+ * Compares the old byte-then-bit loop, which always restarts at bit 0,
+ * with the word-at-a-time scanner (first fit and with a search hint)
+ * and with alloc_bmap_range() for contiguous runs.
+ *
+ * Usage: bmap-bench [bitmap bytes] [percentage prefilled]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <simplefs-lib.h>
+
+#define DEFAULT_BMAP_LEN	(128 * 1024)	/* 1M blocks, 4GB of 4K blocks */
+#define DEFAULT_PERC_FULL	90
+#define NR_RUN_BLOCKS		16
+
+/* The allocator as it was before the word scanner. */
+static int32_t byte_alloc_bmap(char *bitmap,int32_t bmap_len) {
+	int32_t i = 0,j = 0;
+	for(;i<bmap_len;i++) {
+		if( (bitmap[i] & 0xff) !=0xff) {
+			for(j=0;j<8;j++) {
+				if( !(bitmap[i] & (1<<j))) {
+					bitmap[i]|=(1<<j);
+					break;
+				}
+			}
+			return i*8 + j ;
+		}
+	}
+return -1;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void prefill(char *bitmap, int32_t bmap_len, int perc)
+{
+	memset(bitmap, 0, bmap_len);
+	memset(bitmap, 0xff, (int64_t)bmap_len * perc / 100);
+}
+
+static void report(const char *name, double ns, int32_t nr)
+{
+	printf(" %-28s %10d allocs %12.1f ns/alloc\n", name, nr, nr ? ns / nr : 0);
+}
+
+int main(int argc, char *argv[])
+{
+	int32_t bmap_len = DEFAULT_BMAP_LEN;
+	int perc = DEFAULT_PERC_FULL;
+	int32_t nr_free, nr, hint = 0;
+	char *bitmap;
+	double start;
+
+	if (argc > 1)
+		bmap_len = atoi(argv[1]) & ~7;
+	if (argc > 2)
+		perc = atoi(argv[2]);
+	if (bmap_len <= 0 || perc < 0 || perc > 100) {
+		printf("Usage: bmap-bench [bitmap bytes] [percentage prefilled]\n");
+		return EXIT_FAILURE;
+	}
+	bitmap = malloc(bmap_len);
+	if (!bitmap) {
+		printf("Couldn't allocate enough memory. Exiting...\n");
+		return EXIT_FAILURE;
+	}
+	nr_free = bmap_len * 8 - (int64_t)bmap_len * perc / 100 * 8;
+	printf(" bitmap of %d bytes (%d blocks), %d%% prefilled, %d free\n",
+		bmap_len, bmap_len * 8, perc, nr_free);
+
+	prefill(bitmap, bmap_len, perc);
+	start = now_ns();
+	for (nr = 0; byte_alloc_bmap(bitmap, bmap_len) >= 0; nr++)
+		;
+	report("byte loop (old alloc_bmap)", now_ns() - start, nr);
+
+	prefill(bitmap, bmap_len, perc);
+	start = now_ns();
+	for (nr = 0; alloc_bmap(bitmap, bmap_len) >= 0; nr++)
+		;
+	report("word scan, first fit", now_ns() - start, nr);
+
+	prefill(bitmap, bmap_len, perc);
+	start = now_ns();
+	for (nr = 0; alloc_bmap_hint(bitmap, bmap_len, &hint) >= 0; nr++)
+		;
+	report("word scan, with hint", now_ns() - start, nr);
+
+	prefill(bitmap, bmap_len, perc);
+	hint = 0;
+	start = now_ns();
+	for (nr = 0; (hint = alloc_bmap_range(bitmap, bmap_len, hint,
+					NR_RUN_BLOCKS)) >= 0; nr++)
+		hint += NR_RUN_BLOCKS;
+	report("range of 16 blocks", now_ns() - start, nr);
+
+	free(bitmap);
+	return 0;
+}
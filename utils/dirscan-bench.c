@@ -0,0 +1,280 @@
+/*
+ * Userspace microbenchmark for the directory name scan in simplefs-lib.c.
+ *
+ * Builds a synthetic directory in both record formats and looks every
+ * name up in it, then as many names which aren't there. Compares the
+ * old strncmp() and strcmp() loops over fixed records with a decode
+ * then memcmp() loop and with simplefs_dirblock_find() over packed ones.
+ *
+ * Usage: dirscan-bench [number of entries]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <simple.h>
+#include <simplefs-lib.h>
+
+#define DEFAULT_NR_ENTRIES	4096
+#define BLOCK_SIZE		SIMPLEFS_DEFAULT_BLOCK_SIZE
+#define FIXED_PER_BLOCK		(BLOCK_SIZE / sizeof(struct simplefs_dir_record))
+
+struct dir {
+	char *blocks;
+	int nr_blocks;
+	uint32_t *end;		/*Bytes of records in each block*/
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void name_of(char *buf, const char *prefix, int i)
+{
+	sprintf(buf, "%s-%d", prefix, i);
+}
+
+static int build_fixed(struct dir *dir, int nr)
+{
+	char name[SIMPLEFS_FILENAME_MAXLEN + 1];
+	int i;
+
+	dir->nr_blocks = (nr + FIXED_PER_BLOCK - 1) / FIXED_PER_BLOCK;
+	dir->blocks = calloc(dir->nr_blocks, BLOCK_SIZE);
+	dir->end = calloc(dir->nr_blocks, sizeof(*dir->end));
+	if (!dir->blocks || !dir->end)
+		return -1;
+	for (i = 0; i < nr; i++) {
+		struct simplefs_dir_record *rec = (void *)(dir->blocks +
+			(i / FIXED_PER_BLOCK) * BLOCK_SIZE) +
+			(i % FIXED_PER_BLOCK) * sizeof(*rec);
+
+		name_of(name, "file", i);
+		rec->inode_no = htole64(i + 2);
+		rec->name_len = strlen(name);
+		strcpy(rec->filename, name);
+		dir->end[i / FIXED_PER_BLOCK] += sizeof(*rec);
+	}
+	return 0;
+}
+
+static int build_packed(struct dir *dir, int nr)
+{
+	char name[SIMPLEFS_FILENAME_MAXLEN + 1];
+	struct simplefs_dir_record_i *rec = NULL;
+	uint32_t off = BLOCK_SIZE;
+	int i, len;
+
+	/* Names are at most 16 bytes here, 24 byte records at worst */
+	dir->nr_blocks = (nr + BLOCK_SIZE / 32 - 1) / (BLOCK_SIZE / 32) + 1;
+	dir->blocks = calloc(dir->nr_blocks, BLOCK_SIZE);
+	dir->end = calloc(dir->nr_blocks, sizeof(*dir->end));
+	if (!dir->blocks || !dir->end)
+		return -1;
+	dir->nr_blocks = 0;
+	for (i = 0; i < nr; i++) {
+		name_of(name, "file", i);
+		len = strlen(name);
+		if (off + DIR_RECORD_LEN(len) > BLOCK_SIZE) {
+			/* The last record of a block covers it to its end */
+			if (rec)
+				rec->rec_len = htole16(BLOCK_SIZE -
+					((char *)rec - dir->blocks) % BLOCK_SIZE);
+			dir->end[dir->nr_blocks++] = BLOCK_SIZE;
+			off = 0;
+		}
+		rec = (void *)(dir->blocks +
+			(dir->nr_blocks - 1) * BLOCK_SIZE + off);
+		rec->inode_no = htole64(i + 2);
+		rec->rec_len = htole16(DIR_RECORD_LEN(len));
+		rec->name_len = len;
+		rec->file_type = SIMPLEFS_FT_REG_FILE;
+		memcpy(rec->filename, name, len);
+		off += DIR_RECORD_LEN(len);
+	}
+	if (rec)
+		rec->rec_len = htole16(BLOCK_SIZE -
+			((char *)rec - dir->blocks) % BLOCK_SIZE);
+	return 0;
+}
+
+/* simplefs_locate_inode() before the lookup went to dir.c */
+static uint64_t find_fixed_strncmp(struct dir *dir, const char *name)
+{
+	int b;
+	uint32_t off;
+
+	for (b = 0; b < dir->nr_blocks; b++)
+		for (off = 0; off < dir->end[b];
+				off += sizeof(struct simplefs_dir_record)) {
+			struct simplefs_dir_record *rec =
+				(void *)(dir->blocks + b * BLOCK_SIZE + off);
+
+			if (!strncmp(rec->filename, name, strlen(name)))
+				return le64toh(rec->inode_no);
+		}
+	return 0;
+}
+
+/* The legacy lookup */
+static uint64_t find_fixed_strcmp(struct dir *dir, const char *name)
+{
+	int b;
+	uint32_t off;
+
+	for (b = 0; b < dir->nr_blocks; b++)
+		for (off = 0; off < dir->end[b];
+				off += sizeof(struct simplefs_dir_record)) {
+			struct simplefs_dir_record *rec =
+				(void *)(dir->blocks + b * BLOCK_SIZE + off);
+
+			if (!strcmp(rec->filename, name))
+				return le64toh(rec->inode_no);
+		}
+	return 0;
+}
+
+/* Fixed records, length first then simplefs_name_eq() */
+static uint64_t find_fixed_len(struct dir *dir, const char *name, int len)
+{
+	int b;
+	uint32_t off;
+
+	for (b = 0; b < dir->nr_blocks; b++)
+		for (off = 0; off < dir->end[b];
+				off += sizeof(struct simplefs_dir_record)) {
+			struct simplefs_dir_record *rec =
+				(void *)(dir->blocks + b * BLOCK_SIZE + off);
+
+			if (rec->inode_no && rec->name_len == len &&
+			    simplefs_name_eq(rec->filename, name, len))
+				return le64toh(rec->inode_no);
+		}
+	return 0;
+}
+
+/* Each packed record decoded in full, then memcmp() */
+static uint64_t find_packed_memcmp(struct dir *dir, const char *name, int len)
+{
+	int b;
+
+	for (b = 0; b < dir->nr_blocks; b++) {
+		const char *block = dir->blocks + b * BLOCK_SIZE;
+		uint32_t off = 0;
+
+		while (off < dir->end[b]) {
+			struct simplefs_dir_record_i *rec = (void *)(block + off);
+			uint16_t rec_len = le16toh(rec->rec_len);
+			uint64_t ino = le64toh(rec->inode_no);
+
+			if (rec_len < DIR_RECORD_BASE_SIZE ||
+			    rec_len > dir->end[b] - off)
+				return 0;
+			if (ino && rec->name_len == len &&
+			    !memcmp(rec->filename, name, len))
+				return ino;
+			off += rec_len;
+		}
+	}
+	return 0;
+}
+
+static uint64_t find_packed_scan(struct dir *dir, const char *name, int len)
+{
+	int b;
+
+	for (b = 0; b < dir->nr_blocks; b++) {
+		const char *block = dir->blocks + b * BLOCK_SIZE;
+		int32_t off = simplefs_dirblock_find(block, dir->end[b], name, len);
+
+		if (off >= 0)
+			return le64toh(((struct simplefs_dir_record_i *)
+					(block + off))->inode_no);
+		if (off == -2)
+			return 0;
+	}
+	return 0;
+}
+
+enum { FIXED_STRNCMP, FIXED_STRCMP, FIXED_LEN, PACKED_MEMCMP, PACKED_SCAN };
+
+static uint64_t find(int how, struct dir *fixed, struct dir *packed,
+			const char *name, int len)
+{
+	switch (how) {
+	case FIXED_STRNCMP:
+		return find_fixed_strncmp(fixed, name);
+	case FIXED_STRCMP:
+		return find_fixed_strcmp(fixed, name);
+	case FIXED_LEN:
+		return find_fixed_len(fixed, name, len);
+	case PACKED_MEMCMP:
+		return find_packed_memcmp(packed, name, len);
+	}
+	return find_packed_scan(packed, name, len);
+}
+
+static void run(const char *title, int how, struct dir *fixed,
+		struct dir *packed, int nr)
+{
+	char name[SIMPLEFS_FILENAME_MAXLEN + 1];
+	double start, hit_ns, miss_ns;
+	int i, wrong = 0;
+
+	start = now_ns();
+	for (i = 0; i < nr; i++) {
+		name_of(name, "file", i);
+		if (find(how, fixed, packed, name, strlen(name)) !=
+				(uint64_t)i + 2)
+			wrong++;
+	}
+	hit_ns = now_ns() - start;
+	start = now_ns();
+	for (i = 0; i < nr; i++) {
+		name_of(name, "miss", i);
+		if (find(how, fixed, packed, name, strlen(name)))
+			wrong++;
+	}
+	miss_ns = now_ns() - start;
+	printf(" %-28s %12.1f ns/hit %12.1f ns/miss", title,
+		hit_ns / nr, miss_ns / nr);
+	if (wrong)
+		printf("  (%d wrong answers)", wrong);
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int nr = DEFAULT_NR_ENTRIES;
+	struct dir fixed, packed;
+
+	if (argc > 1)
+		nr = atoi(argv[1]);
+	if (nr <= 0) {
+		printf("Usage: dirscan-bench [number of entries]\n");
+		return EXIT_FAILURE;
+	}
+	if (build_fixed(&fixed, nr) || build_packed(&packed, nr)) {
+		printf("Couldn't allocate enough memory. Exiting...\n");
+		return EXIT_FAILURE;
+	}
+	printf(" %d entries, %d fixed blocks, %d packed blocks\n",
+		nr, fixed.nr_blocks, packed.nr_blocks);
+
+	run("fixed, strncmp (old)", FIXED_STRNCMP, &fixed, &packed, nr);
+	run("fixed, strcmp (legacy)", FIXED_STRCMP, &fixed, &packed, nr);
+	run("fixed, length then words", FIXED_LEN, &fixed, &packed, nr);
+	run("packed, decode and memcmp", PACKED_MEMCMP, &fixed, &packed, nr);
+	run("packed, dirblock_find", PACKED_SCAN, &fixed, &packed, nr);
+
+	free(fixed.blocks);
+	free(fixed.end);
+	free(packed.blocks);
+	free(packed.end);
+	return 0;
+}
@@ -0,0 +1,74 @@
+#!/bin/sh
+#
+# Check that files on a default mkfs image, which start inline, can be
+# preallocated and then written:
+#
+#   empty file:  create -> fallocate 1M -> write 200000 bytes
+#   inline file: create with 100 bytes -> fallocate 1M -> append 5000
+#
+# and that both read back right after a remount.
+#
+# Run as root from the top of the tree after make and make -C utils.
+# Loads simplefs.ko if it isn't loaded yet.
+#
+# Usage: utils/fallocate-check.sh [image]
+
+IMG=${1:-/tmp/simplefs-fallocate.img}
+MNT=$(mktemp -d)
+TMP=$(mktemp -d)
+
+cleanup()
+{
+	umount "$MNT" 2>/dev/null
+	rmdir "$MNT"
+	rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+fail()
+{
+	echo "FAIL: $*"
+	exit 1
+}
+
+size_of()
+{
+	stat -c %s "$1"
+}
+
+set -e
+dd if=/dev/zero of="$IMG" bs=4096 count=4096 2>/dev/null
+utils/mkfs-simplefs "$IMG" >/dev/null
+lsmod | grep -q '^simplefs ' || insmod simplefs.ko
+mount -o loop -t simplefs "$IMG" "$MNT"
+
+head -c 200000 /dev/urandom > "$TMP/big"
+head -c 100 /dev/urandom > "$TMP/small"
+head -c 5000 /dev/urandom > "$TMP/tail"
+
+# Empty file, still inline when fallocate gets to it
+touch "$MNT/empty"
+fallocate -l 1M "$MNT/empty" || fail "fallocate of an empty file"
+[ "$(size_of "$MNT/empty")" = 1048576 ] || fail "empty file size after fallocate"
+dd if="$TMP/big" of="$MNT/empty" conv=notrunc 2>/dev/null
+
+# Inline file with contents, they have to survive the move to extents
+cp "$TMP/small" "$MNT/small"
+fallocate -l 1M "$MNT/small" || fail "fallocate of an inline file"
+dd if="$TMP/tail" of="$MNT/small" bs=100 seek=1 conv=notrunc 2>/dev/null
+
+umount "$MNT"
+mount -o loop -t simplefs "$IMG" "$MNT"
+
+[ "$(size_of "$MNT/empty")" = 1048576 ] || fail "empty file size after remount"
+cmp -n 200000 "$TMP/big" "$MNT/empty" || fail "empty file contents"
+[ -z "$(tail -c +200001 "$MNT/empty" | tr -d '\0')" ] ||
+	fail "unwritten part of the empty file isn't zero"
+
+[ "$(size_of "$MNT/small")" = 1048576 ] || fail "inline file size after remount"
+cat "$TMP/small" "$TMP/tail" > "$TMP/expect"
+cmp -n 5100 "$TMP/expect" "$MNT/small" || fail "inline file contents"
+[ -z "$(tail -c +5101 "$MNT/small" | tr -d '\0')" ] ||
+	fail "unwritten part of the inline file isn't zero"
+
+echo "PASS"
@@ -0,0 +1,83 @@
+#!/bin/sh
+#
+# Sequential write and read throughput of one file on a loop mounted
+# image, with the average request size the loop device saw. Run it
+# once with the module before a change and once after, on the same
+# machine, and compare.
+#
+# dd is always run. fio runs as well when it is installed.
+#
+# Run as root from the top of the tree after make and make -C utils.
+# Loads simplefs.ko if it isn't loaded yet.
+#
+# Usage: utils/loop-throughput.sh [file size in MB] [mount options]
+#   e.g. utils/loop-throughput.sh 64 nodelalloc
+
+MB=${1:-64}
+OPTS=${2:-defaults}
+IMG=/tmp/simplefs-throughput.img
+MNT=$(mktemp -d)
+LOOP=
+
+cleanup()
+{
+	umount "$MNT" 2>/dev/null
+	[ -n "$LOOP" ] && losetup -d "$LOOP"
+	rmdir "$MNT"
+}
+trap cleanup EXIT
+
+# Reads and writes completed and sectors moved so far, from the
+# block layer statistics of the loop device
+io_stat()
+{
+	awk '{ print $1, $3, $5, $7 }' /sys/block/$(basename "$LOOP")/stat
+}
+
+# Prints the average request size between two io_stat samples
+report()
+{
+	echo "$1 $2" | awk -v what="$3" '{
+		ios = what == "read" ? $5 - $1 : $7 - $3;
+		sectors = what == "read" ? $6 - $2 : $8 - $4;
+		if (ios)
+			printf("  %s: %d requests, %.1f KB per request\n",
+				what, ios, sectors * 512 / ios / 1024);
+	}'
+}
+
+drop_caches()
+{
+	sync
+	echo 3 > /proc/sys/vm/drop_caches
+}
+
+set -e
+# Room for the file, its tables and the metadata
+dd if=/dev/zero of="$IMG" bs=1M count=$((MB + MB / 4 + 16)) 2>/dev/null
+utils/mkfs-simplefs "$IMG" >/dev/null
+lsmod | grep -q '^simplefs ' || insmod simplefs.ko
+LOOP=$(losetup -f --show "$IMG")
+mount -t simplefs -o "$OPTS" "$LOOP" "$MNT"
+
+echo "dd, ${MB}MB, mount options $OPTS"
+before=$(io_stat)
+dd if=/dev/zero of="$MNT/dd" bs=1M count="$MB" conv=fsync 2>&1 | tail -n 1
+report "$before" "$(io_stat)" write
+drop_caches
+before=$(io_stat)
+dd if="$MNT/dd" of=/dev/null bs=1M 2>&1 | tail -n 1
+report "$before" "$(io_stat)" read
+rm -f "$MNT/dd"
+
+if command -v fio >/dev/null; then
+	echo "fio, ${MB}MB, mount options $OPTS"
+	drop_caches
+	fio --name=write --directory="$MNT" --filename=fio --rw=write \
+		--bs=1M --size="${MB}M" --end_fsync=1 --minimal |
+		awk -F';' '{ printf("  write: %d KB/s\n", $48) }'
+	drop_caches
+	fio --name=read --directory="$MNT" --filename=fio --rw=read \
+		--bs=1M --size="${MB}M" --minimal |
+		awk -F';' '{ printf("  read: %d KB/s\n", $7) }'
+fi
@@ -22,7 +22,7 @@
 
 int main(int argc, char *argv[])
 {
-	int fd, nbytes,i;
+	int fd,i;
 	uint64_t nr_blocks;
 	uint64_t nr_inodes;
 	uint16_t nr_inodes_per_block;
@@ -41,7 +41,7 @@ int main(int argc, char *argv[])
 	const uint64_t WELCOMEFILE_INODE_NUMBER = 2;
 	char *buffer = NULL;
 
-	struct simplefs_dir_record record;
+	struct simplefs_dir_record_i *record;
 	printf(" mkfs-simplefs\n Version %d\n Author: Pranay Kr. Srivastava\n",VERSION);
 	printf(" ----------------------------------------------------------------------\n");
 	printf(" Setting block size to %d\n",SIMPLEFS_DEFAULT_BLOCK_SIZE); 
@@ -68,6 +68,9 @@ int main(int argc, char *argv[])
 	}
 
 	/* Begin writing of Block 0 - Super Block */
+	memset(&sb,0,sizeof(sb));
+	memset(&root_inode,0,sizeof(root_inode));
+	memset(&welcomefile_inode,0,sizeof(welcomefile_inode));
 #ifdef __BIG_ENDIAN_
 	sb.char_version[0] = SIMPLEFS_ENDIANESS_BIG;
 #else
@@ -75,6 +78,9 @@ int main(int argc, char *argv[])
 #endif
 	sb.magic = SIMPLEFS_MAGIC;
 	sb.block_size = SIMPLEFS_DEFAULT_BLOCK_SIZE;
+	sb.features = SIMPLEFS_FEATURE_LARGE_INODE | SIMPLEFS_FEATURE_EXTENTS |
+		SIMPLEFS_FEATURE_INLINE_DATA | SIMPLEFS_FEATURE_DIR_INDEX |
+		SIMPLEFS_FEATURE_DIR_PACKED;
 
 	/* One inode for rootdirectory and another for a welcome file that we are going to create */
 	sb.inodes_count = 2;
@@ -168,9 +174,15 @@ int main(int argc, char *argv[])
 
 	welcomefile_inode.mode = S_IFREG;
 	welcomefile_inode.inode_no = WELCOMEFILE_INODE_NUMBER;
-	welcomefile_inode.data_block_number = nr_blocks_written++;
 	welcomefile_inode.file_size = sizeof(welcomefile_body);
 	welcomefile_inode.m_time = welcomefile_inode.c_time = time(NULL);
+	/*
+	 * The welcome file is small enough to live in its inode,
+	 * it gets no data block.
+	 */
+	welcomefile_inode.flags = SIMPLEFS_INODE_INLINE;
+	memcpy(welcomefile_inode.inline_data,welcomefile_body,
+		sizeof(welcomefile_body));
 	if(! (sb.char_version[0] & SIMPLEFS_ENDIANESS_LITTLE))
 		cpu_inode_to(le,&welcomefile_inode);
 	memcpy(buffer+SIMPLEFS_INODE_SIZE,&welcomefile_inode,SIMPLEFS_INODE_SIZE);
@@ -239,16 +251,15 @@ int main(int argc, char *argv[])
 		goto exit;
 	}
 	memset(buffer,0,sb.block_size);	
-	strcpy(record.filename, welcomefile_name);
-	record.inode_no = WELCOMEFILE_INODE_NUMBER;
-	record.name_len = strlen(record.filename);
-	if(! (sb.char_version[0] & SIMPLEFS_ENDIANESS_LITTLE)) {
-		record.inode_no = cpu_to_le(record.inode_no,64);
-	}
-	nbytes = sizeof(record);
-	memcpy(buffer,&record,dir_record_len(&record));
-
-	if ( (ret = write(fd, buffer,dir_record_len(&record))) != dir_record_len(&record) ) {
+	/* The only record of the block, it takes all of it */
+	record = (struct simplefs_dir_record_i *)buffer;
+	record->inode_no = cpu_to_le(WELCOMEFILE_INODE_NUMBER,64);
+	record->rec_len = cpu_to_le(sb.block_size,16);
+	record->name_len = strlen(welcomefile_name);
+	record->file_type = SIMPLEFS_FT_REG_FILE;
+	memcpy(record->filename,welcomefile_name,record->name_len);
+
+	if ( (ret = write(fd, buffer,sb.block_size)) != sb.block_size ) {
 		printf
 		    ("Writing the rootdirectory datablock (name+inode_no pair for welcomefile) has failed\n");
 		ret = -1;
@@ -258,23 +269,6 @@ int main(int argc, char *argv[])
 	    ("root directory datablocks (name+inode_no pair for welcomefile) written succesfully\n");
 	/* End of writing of Block 2 - Root directory contents */
 
-	/* Begin writing of Block 3 - Welcome file contents */
-	nbytes = sizeof(welcomefile_body);
-	memcpy(buffer,welcomefile_body,nbytes);
-
-	if( (ret = lseek(fd,welcomefile_inode.data_block_number * sb.block_size,SEEK_SET)) < 0){
-		perror("Unable to seek into device [Data block welcome file]\n");
-		goto exit;
-	}
-
-	ret = write(fd, buffer, nbytes);
-	if (ret != nbytes) {
-		printf("Writing welcomefile body has failed\n");
-		ret = -1;
-		goto exit;
-	}
-	printf("welcomefilebody has been written succesfully\n");
-
 	/*Finally write the super block*/
 	sb.free_blocks = nr_blocks - nr_blocks_written;
 
@@ -292,7 +286,6 @@ int main(int argc, char *argv[])
 			" written %zd of %d bytes\n",ret,sb.block_size);
 		goto exit;
 	}
-	/* End of writing of Block 3 - Welcome file contents */
 	ret = 0;
 	if(! (sb.char_version[0] & SIMPLEFS_ENDIANESS_LITTLE)) {
 		super_to_cpu(le,&sb);
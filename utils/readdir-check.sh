@@ -0,0 +1,78 @@
+#!/bin/sh
+#
+# Check that readdir returns every entry of a directory, several to a
+# getdents call:
+#
+#   linear: 40 files, all in the first directory block
+#   hashed: 2000 files, enough to convert the directory to an index
+#
+# and that both list the same after a remount.
+#
+# Run as root from the top of the tree after make and make -C utils.
+# Loads simplefs.ko if it isn't loaded yet.
+#
+# Usage: utils/readdir-check.sh [image]
+
+IMG=${1:-/tmp/simplefs-readdir.img}
+MNT=$(mktemp -d)
+TMP=$(mktemp -d)
+
+cleanup()
+{
+	umount "$MNT" 2>/dev/null
+	rmdir "$MNT"
+	rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+fail()
+{
+	echo "FAIL: $*"
+	exit 1
+}
+
+# make_dir <dir> <number of files>, the expected listing goes to
+# $TMP/<dir>
+make_dir()
+{
+	mkdir "$MNT/$1"
+	i=0
+	while [ $i -lt $2 ]; do
+		touch "$MNT/$1/file-$i"
+		echo "file-$i"
+		i=$((i + 1))
+	done | sort > "$TMP/$1"
+}
+
+# check_dir <dir>, ls -f lists in readdir order without a stat
+check_dir()
+{
+	ls -f "$MNT/$1" | grep -v '^\.\.\?$' | sort > "$TMP/$1.got"
+	cmp -s "$TMP/$1" "$TMP/$1.got" ||
+		fail "$1: $(wc -l < "$TMP/$1.got") of $(wc -l < "$TMP/$1") entries listed"
+	# One entry per call would mean readdir stops after each record
+	if command -v strace >/dev/null; then
+		calls=$(strace -e trace=getdents,getdents64 ls -f "$MNT/$1" \
+			2>&1 >/dev/null | grep -c '^getdents')
+		[ "$calls" -lt $(($(wc -l < "$TMP/$1") / 4)) ] ||
+			fail "$1: $calls getdents calls"
+	fi
+}
+
+set -e
+dd if=/dev/zero of="$IMG" bs=4096 count=4096 2>/dev/null
+utils/mkfs-simplefs "$IMG" >/dev/null
+lsmod | grep -q '^simplefs ' || insmod simplefs.ko
+mount -o loop -t simplefs "$IMG" "$MNT"
+
+make_dir linear 40
+make_dir hashed 2000
+check_dir linear
+check_dir hashed
+
+umount "$MNT"
+mount -o loop -t simplefs "$IMG" "$MNT"
+check_dir linear
+check_dir hashed
+
+echo "PASS"
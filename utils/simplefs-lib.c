@@ -1,19 +1,163 @@
 #include <simplefs-lib.h>
 
-int32_t alloc_bmap(char *bitmap,int32_t bmap_len) {
-	int32_t i = 0,j = 0;
-	for(;i<bmap_len;i++) {
-		if( (bitmap[i] & 0xff) !=0xff) {
-			for(j=0;j<8;j++) {
-				if( !(bitmap[i] & (1<<j))) {
-					bitmap[i]|=(1<<j);
-					break;
-				}
-			}
-			return i*8 + j ; /*Bit numbers are starting from 0*/
+/*
+ * The bitmaps are stored on disk as a plain array of bytes where
+ * bit j of byte i stands for object number (i*8 + j). Reading that
+ * array 64 bits at a time as a little endian word keeps the same
+ * numbering, so bit (i*64 + k) is bit k of word i on every cpu.
+ */
+#ifdef __KERNEL__
+#define bmap_le64(w)	le64_to_cpu(w)
+#define bmap_ffs(w)	__ffs64(w)
+#else
+#define bmap_le64(w)	le64toh(w)
+#define bmap_ffs(w)	__builtin_ctzll(w)
+#endif
+
+#define BMAP_WORD_BITS	64
+
+/*
+ * Fetch the i-th 64 bit word of the bitmap. A short last word is
+ * padded with ones so that the padding is never handed out.
+ */
+static inline uint64_t bmap_word(const char *bitmap, int32_t bmap_len,
+				int32_t i)
+{
+	uint64_t w = ~0ULL;
+	int32_t off = i << 3;
+
+	if (off + 8 <= bmap_len)
+		return bmap_le64(*(const uint64_t *)(bitmap + off));
+	memcpy(&w, bitmap + off, bmap_len - off);
+	return bmap_le64(w);
+}
+
+/*
+ * Return the first bit in [start, limit) which is clear (set == 0)
+ * or set (set != 0). Returns -1 if there is none.
+ */
+static int32_t bmap_find_next(const char *bitmap, int32_t bmap_len,
+				int32_t start, int32_t limit, int set)
+{
+	int32_t i = start / BMAP_WORD_BITS;
+	int32_t last;
+	uint64_t w;
+
+	if (limit > (bmap_len << 3))
+		limit = bmap_len << 3;
+	if (start < 0 || start >= limit)
+		return -1;
+	last = (limit - 1) / BMAP_WORD_BITS;
+	w = bmap_word(bitmap, bmap_len, i);
+	if (!set)
+		w = ~w;
+	w &= ~0ULL << (start % BMAP_WORD_BITS);
+	while (!w) {
+		if (++i > last)
+			return -1;
+		w = bmap_word(bitmap, bmap_len, i);
+		if (!set)
+			w = ~w;
+	}
+	start = i * BMAP_WORD_BITS + bmap_ffs(w);
+	return start < limit ? start : -1;
+}
+
+static void bmap_set_range(char *bitmap, int32_t start, int32_t count)
+{
+	while (count && (start & 7)) {
+		bitmap[start >> 3] |= (1 << (start & 7));
+		start++;
+		count--;
+	}
+	if (count >= 8) {
+		memset(bitmap + (start >> 3), 0xff, count >> 3);
+		start += count & ~7;
+		count &= 7;
+	}
+	while (count--) {
+		bitmap[start >> 3] |= (1 << (start & 7));
+		start++;
+	}
+}
+
+int32_t find_bmap_zero(const char *bitmap, int32_t bmap_len, int32_t start)
+{
+	return bmap_find_next(bitmap, bmap_len, start, bmap_len << 3, 0);
+}
+
+int32_t find_bmap_one(const char *bitmap, int32_t bmap_len, int32_t start)
+{
+	return bmap_find_next(bitmap, bmap_len, start, bmap_len << 3, 1);
+}
+
+/*
+ * Find count consecutive clear bits, preferring the ones at or after
+ * goal and wrapping around to the start of the bitmap if needed.
+ * The run is marked in use and its first bit number is returned,
+ * -1 if no such run exists.
+ */
+int32_t alloc_bmap_range(char *bitmap, int32_t bmap_len,
+			int32_t goal, int32_t count)
+{
+	int32_t nr_bits = bmap_len << 3;
+	int32_t start, zero, end;
+	int wrapped = 0;
+
+	if (count <= 0 || count > nr_bits)
+		return -1;
+	if (goal < 0 || goal >= nr_bits)
+		goal = 0;
+	start = goal;
+	for (;;) {
+		zero = bmap_find_next(bitmap, bmap_len, start, nr_bits, 0);
+		if (zero < 0 || (wrapped && zero >= goal)) {
+			if (wrapped || !goal)
+				return -1;
+			wrapped = 1;
+			start = 0;
+			continue;
+		}
+		/* Only the next count bits matter, don't look any further */
+		end = bmap_find_next(bitmap, bmap_len, zero + 1, zero + count, 1);
+		if (end < 0) {
+			if (zero + count > nr_bits)
+				end = nr_bits;
+			else
+				end = zero + count;
 		}
+		if (end - zero >= count) {
+			bmap_set_range(bitmap, zero, count);
+			return zero;
+		}
+		if (end >= nr_bits) {
+			if (wrapped || !goal)
+				return -1;
+			wrapped = 1;
+			start = 0;
+			continue;
+		}
+		start = end;
 	}
-return -1;
+}
+
+/*
+ * Allocate a single bit starting the search from *hint, which is
+ * moved past the allocated bit so the next call does not walk over
+ * the same full words again.
+ */
+int32_t alloc_bmap_hint(char *bitmap, int32_t bmap_len, int32_t *hint)
+{
+	int32_t bit = alloc_bmap_range(bitmap, bmap_len, *hint, 1);
+
+	if (bit >= 0)
+		*hint = (bit + 1 < (bmap_len << 3)) ? bit + 1 : 0;
+	return bit;
+}
+
+int32_t alloc_bmap(char *bitmap,int32_t bmap_len) {
+	/*Bit numbers are starting from 0*/
+	return alloc_bmap_range(bitmap, bmap_len, 0, 1);
 }
 
 int free_bmap(char *bitmap,int32_t bmap_len, int loc) {
@@ -27,3 +171,64 @@ int free_bmap(char *bitmap,int32_t bmap_len, int loc) {
 	bitmap[i] &= ~(1<<j);
 	return old_val;
 }
+
+/* 32 bit FNV-1a */
+uint32_t simplefs_name_hash(const char *name, int len)
+{
+	uint32_t hash = 2166136261U;
+
+	while (len--) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/*
+ * A packed directory record, struct simplefs_dir_record_i in simple.h:
+ * inode_no at 0, rec_len at 8, name_len at 10 and the name from 12 on.
+ * Records are 8 byte aligned.
+ */
+#define DIRREC_REC_LEN		8
+#define DIRREC_NAME_LEN		10
+#define DIRREC_NAME		12
+
+#ifdef __KERNEL__
+#define dirrec_le16(w)	le16_to_cpu(w)
+#else
+#define dirrec_le16(w)	le16toh(w)
+#endif
+
+int32_t simplefs_dirblock_find(const char *block, uint32_t end,
+				const char *name, int len)
+{
+	uint32_t off = 0;
+
+	while (off < end) {
+		const char *rec = block + off;
+		uint16_t rec_len;
+
+		if (end - off < DIRREC_NAME)
+			return -2;
+		memcpy(&rec_len, rec + DIRREC_REC_LEN, 2);
+		rec_len = dirrec_le16(rec_len);
+		if (rec_len < DIRREC_NAME || rec_len & 7 || rec_len > end - off)
+			return -2;
+		/*
+		 * Most records go on the length byte alone, the rest
+		 * mostly on the first word of their name. A free record
+		 * has inode_no 0 and doesn't match.
+		 */
+		if ((unsigned char)rec[DIRREC_NAME_LEN] == len &&
+		    DIRREC_NAME + len <= rec_len &&
+		    simplefs_name_eq(rec + DIRREC_NAME, name, len)) {
+			uint64_t ino;
+
+			memcpy(&ino, rec, 8);
+			if (ino)
+				return off;
+		}
+		off += rec_len;
+	}
+	return -1;
+}